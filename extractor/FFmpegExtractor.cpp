@@ -23,6 +23,7 @@
 #include <limits.h> /* INT_MAX */
 #include <inttypes.h>
 #include <sys/prctl.h>
+#include <sys/stat.h>
 
 #include <utils/misc.h>
 #include <utils/String8.h>
@@ -42,13 +43,33 @@
 
 #include "codec_utils.h"
 #include "ffmpeg_cmdutils.h"
+#include "ffmpeg_source.h"
+
+extern "C" {
+#include "libavutil/intfloat.h"
+#include "libavutil/intreadwrite.h"
+}
 
 #include "FFmpegExtractor.h"
 
 #define MAX_QUEUE_SIZE (40 * 1024 * 1024)
+#define LOW_RAM_MAX_QUEUE_SIZE (8 * 1024 * 1024)
+#define MAX_QUEUE_PACKETS 8192
 #define MIN_AUDIOQ_SIZE (2 * 1024 * 1024)
-#define MIN_FRAMES 5
-#define EXTRACTOR_MAX_PROBE_PACKETS 200
+#define MIN_FRAMES 5  /* reader thread low watermark, in packets per track */
+#define MAX_FRAMES 50 /* reader thread high watermark, in packets per track */
+#define DEFAULT_DEFERRED_PROBE_KB   8192
+#define DEFAULT_DEFERRED_PROBE_MS   2000
+#define MIN_BUFFER_SIZE (8 * 1024)
+#define MAX_BUFFER_SIZE (32 * 1024 * 1024)
+#define MAX_PREALLOCATED_SIZE (4 * 1024 * 1024) /* per buffer group */
+#define VIDEO_BUFFERS 4
+#define AUDIO_BUFFERS 8
+#define INDEX_MIN_INTERVAL_US 1000000 /* between non-video index entries */
+#define SEEK_COALESCE_POS_US 10000 /* apart, the seeks of one request */
+#define INDEX_MERGE_ENTRIES 256
+#define CACHE_FINGERPRINT_SIZE (16 * 1024)
+#define STREAM_INFO_VERSION 1
 #define FF_MAX_EXTRADATA_SIZE ((1 << 28) - AV_INPUT_BUFFER_PADDING_SIZE)
 
 #define WAIT_KEY_PACKET_AFTER_SEEK 1
@@ -67,6 +88,13 @@ enum {
     SEEK,
 };
 
+/* What to do when the packet queues go over the memory budget */
+enum {
+    BUDGET_POLICY_BLOCK = 0, /* stop reading ahead, only demux on demand */
+    BUDGET_POLICY_DISCARD,   /* discard the streams of tracks not started */
+    BUDGET_POLICY_DROP,      /* drop the fullest queue, re-seek when read */
+};
+
 namespace android {
 
 static const char *findMatchingContainer(const char *name);
@@ -99,51 +127,268 @@ private:
     bool mIsHEVC;
     size_t mNALLengthSize;
     bool mNal2AnnexB;
+    bool mZeroCopy;
 
     AVStream *mStream;
     PacketQueue *mQueue;
 
     int64_t mFirstKeyPktTimestamp;
-    int64_t mLastPTS;
-    int64_t mTargetTime;
+    int64_t mTargetTime; // SEEK_CLOSEST target, until the next buffer
+
+    // trick play: key frames only, mTrickPlayUs apart (backwards if < 0)
+    int64_t mTrickPlayUs;
+    int64_t mTrickTargetUs;
+    int64_t mLastKeyTimeUs;
+    int64_t mLastSyncSeekUs;   // target of the last sync seek, to detect stepping
+    int mReadsSinceSeek;
+
+    void setTrickPlay(int64_t strideUs);
 
     DISALLOW_EVIL_CONSTRUCTORS(FFmpegSource);
 };
 
+/* A media buffer pointing into the payload of a demuxed packet, which is
+ * kept referenced until the buffer is returned. */
+struct FFmpegPacketBuffer : public MediaBufferObserver {
+    static MediaBufferHelper *wrap(AVPacket *pkt);
+
+    virtual void signalBufferReturned(MediaBufferBase *buffer);
+
+private:
+    FFmpegPacketBuffer() : mPacket(NULL), mBuffer(NULL), mHelper(NULL) {}
+    virtual ~FFmpegPacketBuffer();
+
+    AVPacket *mPacket;
+    MediaBuffer *mBuffer;
+    MediaBufferHelper *mHelper;
+
+    DISALLOW_EVIL_CONSTRUCTORS(FFmpegPacketBuffer);
+};
+
 ////////////////////////////////////////////////////////////////////////////////
 
 FFmpegExtractor::FFmpegExtractor(DataSourceHelper *source, const sp<AMessage> &meta)
     : mDataSource(source),
+      mSeekRequests(0),
+      mRequestedSeekPos(AV_NOPTS_VALUE),
+      mPendingSeeks(0),
+      mSeekServing(0),
+      mSeeking(false),
+      mLastSeekPos(AV_NOPTS_VALUE),
+      mLastSeekMode(MediaTrackHelper::ReadOptions::SEEK_PREVIOUS_SYNC),
+      mLastSeekTimeUs(0),
       mAudioQ(NULL),
       mVideoQ(NULL),
+      mPacketPool(NULL),
       mFormatCtx(NULL),
-      mParsedMetadata(false) {
+      mSniffedProbed(false),
+      mStreamInfoCached(false),
+      mStreamInfoFromHeader(false),
+      mInputFormat(NULL),
+      mSniffConfidence(0),
+      mParsedMetadata(false),
+      mProbePending(false),
+      mTracksOpened(false),
+      mSelectedAudioIdx(-1),
+      mSelectedVideoIdx(-1),
+      mVideoConfigOptional(false),
+      mReaderThreadStarted(false),
+      mWaitingForData(0),
+      mReadAhead(true),
+      mThumbnailMode(false),
+      mIndexStreamIdx(-1),
+      mLastIndexedTs(AV_NOPTS_VALUE),
+      mIndexDirty(false),
+      mIndexComplete(false),
+      mCacheKey(0),
+      mIndexerStarted(false),
+      mIndexInitialized(false),
+      mGopCacheBytes(0),
+      mGopRecording(NULL),
+      mGopRun(0),
+      mGopNextRun(1),
+      mGopSeq(0),
+      mGopReplay(NULL),
+      mGopReplayPos(0) {
     ALOGV("FFmpegExtractor::FFmpegExtractor");
 
+    mReaderThreadEnabled = property_get_bool("debug.ffmpeg.extractor.reader-thread", 0);
+    mSeekSkipNonKey = property_get_bool("debug.ffmpeg.extractor.seek-skip-nonkey", 1);
+    mSeekCoalesceUs = property_get_int32("debug.ffmpeg.extractor.seek-coalesce-ms", 1000) * 1000LL;
+    mThumbnailModeEnabled = property_get_bool("debug.ffmpeg.extractor.thumbnail-mode", 1);
+    mGopCacheLimit = FFMAX(property_get_int32("debug.ffmpeg.extractor.gop-cache-mb", 0), 0)
+            * 1024LL * 1024LL;
+    mPoolCopyMax = property_get_int32("debug.ffmpeg.extractor.pool-copy-kb", 16) * 1024;
+    initQueueBudget();
+
     mMeta = AMediaFormat_new();
     fetchStuffsFromSniffedMeta(meta);
 
-    mVideoQ = packet_queue_alloc();
-    mAudioQ = packet_queue_alloc();
-
     int err = initStreams();
     if (err < 0) {
         ALOGE("failed to init ffmpeg");
+        // nothing to open
+        mTracksOpened = true;
         return;
     }
 
-    while (mPktCounter <= EXTRACTOR_MAX_PROBE_PACKETS &&
-           (mDefersToCreateVideoTrack || mDefersToCreateAudioTrack)) {
+    // Until a track is asked for, the metadata comes from the header alone:
+    // no queue, bitstream filter or packet is needed for it.
+    buildHeaderFormats();
+    if (!mHeaderFormats.isEmpty()) {
+        storeStreamInfo();
+    }
+}
+
+/* Publishes the formats of the selected streams as streamComponentOpen()
+ * would, when no packet has to be read for them. Leaves mHeaderFormats
+ * empty otherwise, and the tracks are then opened for the metadata too. */
+void FFmpegExtractor::buildHeaderFormats()
+{
+    int streams[] = { mSelectedAudioIdx, mSelectedVideoIdx };
+
+    for (size_t i = 0; i < NELEM(streams); i++) {
+        if (streams[i] < 0) {
+            continue;
+        }
+
+        AVStream *st = mFormatCtx->streams[streams[i]];
+        AVCodecParameters *avpar = st->codecpar;
+        bool deferred;
+
+        if ((st->disposition & AV_DISPOSITION_ATTACHED_PIC)
+                || avpar->codec_tag == MKTAG('j', 'p', 'e', 'g')) {
+            continue;
+        }
+
+        // as checkExtradata() decides, without setting anything up
+        if (avpar->codec_id == AV_CODEC_ID_AAC) {
+            deferred = avpar->extradata_size <= 0;
+        } else if (avpar->codec_id == AV_CODEC_ID_H264
+                || avpar->codec_id == AV_CODEC_ID_HEVC
+                || avpar->codec_id == AV_CODEC_ID_MPEG4
+                || avpar->codec_id == AV_CODEC_ID_MPEG1VIDEO
+                || avpar->codec_id == AV_CODEC_ID_MPEG2VIDEO
+                || avpar->codec_id == AV_CODEC_ID_VC1
+                || avpar->codec_id == AV_CODEC_ID_AV1) {
+            deferred = !is_extradata_compatible_with_android(avpar);
+        } else {
+            deferred = false;
+        }
+
+        AMediaFormat *meta = AMediaFormat_new();
+        media_status_t status = AMEDIA_ERROR_UNKNOWN;
+        if (!deferred) {
+            status = avpar->codec_type == AVMEDIA_TYPE_VIDEO
+                    ? setVideoFormat(st, meta) : setAudioFormat(st, meta);
+        }
+        if (status != AMEDIA_OK) {
+            AMediaFormat_delete(meta);
+            if (deferred) {
+                ALOGV("[%s] codec config not in the header, opening the tracks",
+                      av_get_media_type_string(avpar->codec_type));
+                clearHeaderFormats();
+                return;
+            }
+            continue;
+        }
+        mHeaderFormats.push_back(meta);
+        mHeaderStreams.push_back(streams[i]);
+    }
+}
+
+void FFmpegExtractor::clearHeaderFormats()
+{
+    for (size_t i = 0; i < mHeaderFormats.size(); ++i) {
+        AMediaFormat_delete(mHeaderFormats.itemAt(i));
+    }
+    mHeaderFormats.clear();
+    mHeaderStreams.clear();
+}
+
+/* Sets up what reading packets needs, and creates the tracks. */
+void FFmpegExtractor::openTracks()
+{
+    {
+        Mutex::Autolock _l(mDemuxLock);
+
+        if (mTracksOpened) {
+            return;
+        }
+        mTracksOpened = true;
+
+        mVideoQ = packet_queue_alloc();
+        mAudioQ = packet_queue_alloc();
+        mPacketPool = packet_pool_alloc();
+
+        if (mSelectedAudioIdx >= 0 && streamComponentOpen(mSelectedAudioIdx) >= 0) {
+            packet_queue_start(mAudioQ);
+        }
+        if (mSelectedVideoIdx >= 0 && streamComponentOpen(mSelectedVideoIdx) >= 0) {
+            packet_queue_start(mVideoQ);
+        }
+        mProbePending = true;
+    }
+
+    probeDeferredTracks();
+}
+
+/* Codecs whose decoders handle parameter sets sent in band, and that
+ * parser_split() does not know */
+static bool hasInBandConfig(enum AVCodecID codec_id)
+{
+    return codec_id == AV_CODEC_ID_HEVC
+            || codec_id == AV_CODEC_ID_VC1
+            || codec_id == AV_CODEC_ID_AV1;
+}
+
+/* Creates the tracks that were deferred until packets show their codec
+ * configuration. */
+void FFmpegExtractor::probeDeferredTracks()
+{
+    Mutex::Autolock _l(mDemuxLock);
+    int err;
+
+    if (!mProbePending) {
+        return;
+    }
+    mProbePending = false;
+
+    // Bounded by what it costs rather than by a packet count, as packet
+    // sizes and rates vary a lot between streams. The packets of the tracks
+    // already created are queued as usual meanwhile.
+    int64_t maxBytes = property_get_int32("debug.ffmpeg.extractor.deferred-probe-kb",
+            DEFAULT_DEFERRED_PROBE_KB) * 1024LL;
+    int64_t maxUs = property_get_int32("debug.ffmpeg.extractor.deferred-probe-ms",
+            DEFAULT_DEFERRED_PROBE_MS) * 1000LL;
+    int64_t startPos = mFormatCtx->pb ? avio_tell(mFormatCtx->pb) : 0;
+    int64_t startUs = get_timestamp();
+
+    while (mDefersToCreateVideoTrack || mDefersToCreateAudioTrack) {
+        int64_t bytes = mFormatCtx->pb ? avio_tell(mFormatCtx->pb) - startPos : 0;
+        int64_t elapsedUs = get_timestamp() - startUs;
+        if (bytes > maxBytes || elapsedUs > maxUs) {
+            ALOGW("deferred track creation gave up after %" PRId64 " bytes, %" PRId64 " ms",
+                  bytes, elapsedUs / 1000);
+            break;
+        }
         err = feedNextPacket();
         if (err < 0 && err != AVERROR(EAGAIN)) {
             ALOGE("deferred track creation failed, %s (%08x)", av_err2str(err), err);
-            return;
+            break;
         }
     }
 
     ALOGV("mPktCounter: %zu, mEOF: %d, pb->error(if has): %d, mDefersToCreateVideoTrack: %d, mDefersToCreateAudioTrack: %d",
           mPktCounter, mEOF, mFormatCtx->pb ? mFormatCtx->pb->error : 0, mDefersToCreateVideoTrack, mDefersToCreateAudioTrack);
 
+    if (mDefersToCreateVideoTrack && hasInBandConfig(mVideoStream->codecpar->codec_id)) {
+        ALOGW("deferred creation of video track failed, creating it without codec config");
+        av_bsf_free(&mVideoBsfc);
+        mVideoConfigOptional = true;
+        streamComponentOpen(mVideoStreamIdx);
+    }
+
     if (mDefersToCreateVideoTrack) {
         ALOGW("deferred creation of video track failed, disabling stream");
         streamComponentClose(mVideoStreamIdx);
@@ -153,32 +398,56 @@ FFmpegExtractor::FFmpegExtractor(DataSourceHelper *source, const sp<AMessage> &m
         ALOGW("deferred creation of audio track failed, disabling stream");
         streamComponentClose(mAudioStreamIdx);
     }
+
+    storeStreamInfo();
 }
 
 FFmpegExtractor::~FFmpegExtractor() {
     ALOGV("FFmpegExtractor::~FFmpegExtractor");
 
     mAbortRequest = 1;
+    stopIndexer();
+    stopReaderThread();
+    storeKeyframeIndex();
     deInitStreams();
 
-    Mutex::Autolock autoLock(mLock);
+    Mutex::Autolock autoLock(mDemuxLock);
 
     packet_queue_free(&mVideoQ);
     packet_queue_free(&mAudioQ);
+    clearGopCache();
+
+    PacketPoolStats stats = {};
+    if (mPacketPool) {
+        packet_pool_get_stats(mPacketPool, &stats);
+    }
+    if (stats.requests > 0) {
+        ALOGD("packet pool requests: %" PRId64 ", allocations: %" PRId64 ", oversized: %" PRId64,
+              stats.requests, stats.allocations, stats.oversized);
+    }
+    packet_pool_free(&mPacketPool);
 
     for (auto& trackInfo : mTracks) {
         AMediaFormat_delete(trackInfo.mMeta);
+        delete trackInfo.mLock;
     }
+    clearHeaderFormats();
     AMediaFormat_delete(mMeta);
 }
 
 size_t FFmpegExtractor::countTracks() {
+    if (!mTracksOpened && !mHeaderFormats.isEmpty()) {
+        return mHeaderFormats.size();
+    }
+    openTracks();
     return mTracks.size();
 }
 
 MediaTrackHelper* FFmpegExtractor::getTrack(size_t index) {
     ALOGV("FFmpegExtractor::getTrack[%zu]", index);
 
+    openTracks();
+
     if (index >= mTracks.size()) {
         return NULL;
     }
@@ -186,18 +455,42 @@ MediaTrackHelper* FFmpegExtractor::getTrack(size_t index) {
     return new FFmpegSource(this, index);
 }
 
-media_status_t FFmpegExtractor::getTrackMetaData(AMediaFormat *meta, size_t index, uint32_t flags __unused) {
+media_status_t FFmpegExtractor::getTrackMetaData(AMediaFormat *meta, size_t index, uint32_t flags) {
     ALOGV("FFmpegExtractor::getTrackMetaData[%zu]", index);
 
+    // The frame retriever asks for the extensive metadata, and only
+    // decodes the video track.
+    bool thumbnail = (flags & kIncludeExtensiveMetaData) && mThumbnailModeEnabled;
+
+    if (!mTracksOpened && !mHeaderFormats.isEmpty() && !thumbnail) {
+        if (index >= mHeaderFormats.size()) {
+            return AMEDIA_ERROR_UNKNOWN;
+        }
+        AMediaFormat *format = mHeaderFormats.itemAt(index);
+        if (mHeaderStreams.itemAt(index) == mSelectedVideoIdx
+                && mFormatCtx->duration != AV_NOPTS_VALUE) {
+            AMediaFormat_setInt64(format, AMEDIAFORMAT_KEY_THUMBNAIL_TIME,
+                    mFormatCtx->duration / 4);
+        }
+        AMediaFormat_copy(meta, format);
+        return AMEDIA_OK;
+    }
+
+    openTracks();
+
     if (index >= mTracks.size()) {
         return AMEDIA_ERROR_UNKNOWN;
     }
 
-    /* Quick and dirty, just get a frame 1/4 in */
     if (mTracks.itemAt(index).mIndex == mVideoStreamIdx &&
             mFormatCtx->duration != AV_NOPTS_VALUE) {
+        int64_t thumbnailTime = mFormatCtx->duration / 4;
+
+        if (thumbnail) {
+            thumbnailTime = enterThumbnailMode(index, thumbnailTime);
+        }
         AMediaFormat_setInt64(mTracks.editItemAt(index).mMeta,
-                AMEDIAFORMAT_KEY_THUMBNAIL_TIME, mFormatCtx->duration / 4);
+                AMEDIAFORMAT_KEY_THUMBNAIL_TIME, thumbnailTime);
     }
 
     AMediaFormat_copy(meta, mTracks.itemAt(index).mMeta);
@@ -228,6 +521,52 @@ uint32_t FFmpegExtractor::flags() const {
     return flags;
 }
 
+/* Looks for the codec configuration of a deferred video track in a packet,
+ * returns AVERROR(EAGAIN) if there is none */
+int FFmpegExtractor::extractVideoExtradata(AVCodecParameters *avpar, const AVPacket *pkt)
+{
+    AVPacket *filtered = NULL;
+    const uint8_t *data = NULL;
+    size_t size = 0;
+    int ret = AVERROR(EAGAIN);
+
+    if (mVideoBsfc) {
+        filtered = av_packet_clone(pkt);
+        if (!filtered) {
+            return AVERROR(ENOMEM);
+        }
+        if (av_bsf_send_packet(mVideoBsfc, filtered) >= 0
+                && av_bsf_receive_packet(mVideoBsfc, filtered) >= 0) {
+            data = av_packet_get_side_data(filtered, AV_PKT_DATA_NEW_EXTRADATA, &size);
+        }
+    } else {
+        int i = parser_split(avpar, pkt->data, pkt->size);
+        if (i > 0) {
+            // sps + pps(there may be sei in it)
+            data = pkt->data;
+            size = i;
+        }
+    }
+
+    if (data && size > 0 && size < FF_MAX_EXTRADATA_SIZE) {
+        ALOGV("[video] extradata found, len=%zu", size);
+        av_freep(&avpar->extradata);
+        avpar->extradata = (uint8_t *)av_mallocz(size + AV_INPUT_BUFFER_PADDING_SIZE);
+        if (avpar->extradata) {
+            memcpy(avpar->extradata, data, size);
+            avpar->extradata_size = size;
+            ret = 0;
+        } else {
+            ALOGE("[video] failed to allocate new extradata");
+            avpar->extradata_size = 0;
+            ret = AVERROR(ENOMEM);
+        }
+    }
+
+    av_packet_free(&filtered);
+    return ret;
+}
+
 int FFmpegExtractor::checkExtradata(AVCodecParameters *avpar)
 {
     enum AVCodecID codec_id = AV_CODEC_ID_NONE;
@@ -248,9 +587,12 @@ int FFmpegExtractor::checkExtradata(AVCodecParameters *avpar)
 
     // ignore extradata
     if (codec_id != AV_CODEC_ID_H264
+            && codec_id != AV_CODEC_ID_HEVC
             && codec_id != AV_CODEC_ID_MPEG4
             && codec_id != AV_CODEC_ID_MPEG1VIDEO
             && codec_id != AV_CODEC_ID_MPEG2VIDEO
+            && codec_id != AV_CODEC_ID_VC1
+            && codec_id != AV_CODEC_ID_AV1
             && codec_id != AV_CODEC_ID_AAC) {
         return 1;
     }
@@ -259,10 +601,27 @@ int FFmpegExtractor::checkExtradata(AVCodecParameters *avpar)
     if (codec_id != AV_CODEC_ID_AAC) {
         int is_compatible = is_extradata_compatible_with_android(avpar);
         if (!is_compatible) {
+            const char* type = av_get_media_type_string(avpar->codec_type);
+            if (hasInBandConfig(codec_id) && mVideoConfigOptional) {
+                ALOGI("[%s] no codec config found, the decoder has to find it in band", type);
+                return 1;
+            }
             ALOGI("[%s] extradata is not compatible with android, should to extract it from bitstream",
-                    av_get_media_type_string(avpar->codec_type));
+                    type);
+            if (!*bsfc) {
+                // parser_split() is the fallback, for H264 and MPEG video only
+                const AVBitStreamFilter* bsf = av_bsf_get_by_name("extract_extradata");
+                if (!bsf || av_bsf_alloc(bsf, bsfc) < 0
+                        || avcodec_parameters_copy((*bsfc)->par_in, avpar) < 0
+                        || av_bsf_init(*bsfc) < 0) {
+                    ALOGW("[%s] (extract_extradata) cannot initialize bitstream filter", type);
+                    av_bsf_free(bsfc);
+                    if (hasInBandConfig(codec_id)) {
+                        return 1;
+                    }
+                }
+            }
             *defersToCreateTrack = true;
-            *bsfc = NULL; // H264 don't need bsfc, only AAC?
             return 0;
         }
         return 1;
@@ -305,6 +664,83 @@ int FFmpegExtractor::checkExtradata(AVCodecParameters *avpar)
     return 1;
 }
 
+/* Containers whose header describes every stream, no frame has to be decoded */
+static const char *HEADER_COMPLETE_FORMATS[] = {
+    "mov,mp4,m4a,3gp,3g2,mj2",
+    "matroska,webm",
+};
+
+static bool isHeaderComplete(const AVInputFormat *fmt)
+{
+    for (size_t i = 0; i < NELEM(HEADER_COMPLETE_FORMATS); ++i) {
+        if (!strcmp(fmt->name, HEADER_COMPLETE_FORMATS[i])) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/* The sample format is only known to the decoder, which most set when
+ * opened: take it from there rather than decoding packets. */
+static bool setSampleFormatFromDecoder(AVCodecParameters *avpar)
+{
+    const AVCodec *codec = avcodec_find_decoder(avpar->codec_id);
+    AVCodecContext *avctx;
+    bool found = false;
+
+    if (!codec) {
+        return false;
+    }
+    avctx = avcodec_alloc_context3(codec);
+    if (!avctx) {
+        return false;
+    }
+    avctx->thread_count = 1;
+    if (avcodec_parameters_to_context(avctx, avpar) >= 0
+            && avcodec_open2(avctx, codec, NULL) >= 0
+            && avctx->sample_fmt != AV_SAMPLE_FMT_NONE) {
+        avpar->format = avctx->sample_fmt;
+        if (avpar->bits_per_raw_sample <= 0) {
+            avpar->bits_per_raw_sample = avctx->bits_per_raw_sample;
+        }
+        found = true;
+    }
+    avcodec_free_context(&avctx);
+    return found;
+}
+
+/* Whether the header gave what setVideoFormat()/setAudioFormat() need */
+static bool hasHeaderStreamInfo(AVStream *stream)
+{
+    AVCodecParameters *avpar = stream->codecpar;
+
+    if (stream->disposition & AV_DISPOSITION_ATTACHED_PIC) {
+        return true;
+    }
+
+    switch (avpar->codec_type) {
+    case AVMEDIA_TYPE_VIDEO:
+        return avpar->codec_id != AV_CODEC_ID_NONE
+                && avpar->width > 0 && avpar->height > 0;
+    case AVMEDIA_TYPE_AUDIO:
+        return avpar->codec_id != AV_CODEC_ID_NONE
+                && avpar->sample_rate > 0 && avpar->ch_layout.nb_channels > 0
+                && (avpar->format != AV_SAMPLE_FMT_NONE || setSampleFormatFromDecoder(avpar));
+    default:
+        return true;
+    }
+}
+
+static int64_t packetTimeUs(const AVPacket *pkt, const AVStream *stream)
+{
+    int64_t ts = pkt->dts != AV_NOPTS_VALUE ? pkt->dts : pkt->pts;
+
+    if (ts == AV_NOPTS_VALUE)
+        return AV_NOPTS_VALUE;
+
+    return av_rescale_q(ts, stream->time_base, AV_TIME_BASE_Q);
+}
+
 static void printTime(int64_t time, const char* type)
 {
     int hours, mins, secs, us;
@@ -696,7 +1132,19 @@ int FFmpegExtractor::streamComponentOpen(int streamIndex)
         trackInfo->mMeta   = meta;
         trackInfo->mStream = mVideoStream;
         trackInfo->mQueue  = mVideoQ;
+        trackInfo->mLock   = new Mutex;
         trackInfo->mSeek   = false;
+        trackInfo->mSeekCovered = false;
+        trackInfo->mKeyOnly     = false;
+        trackInfo->mReplayTs    = AV_NOPTS_VALUE;
+        trackInfo->mStarted     = false;
+        trackInfo->mDiscarded   = false;
+        trackInfo->mResumeTs    = AV_NOPTS_VALUE;
+        trackInfo->mSkipUntilTs = AV_NOPTS_VALUE;
+        trackInfo->mLastTs      = AV_NOPTS_VALUE;
+        trackInfo->mLastQueuedTs = AV_NOPTS_VALUE;
+        trackInfo->mDropUntilTs = AV_NOPTS_VALUE;
+        trackInfo->mMaxPacketSize = 0;
 
         mDefersToCreateVideoTrack = false;
 
@@ -738,7 +1186,19 @@ int FFmpegExtractor::streamComponentOpen(int streamIndex)
         trackInfo->mMeta   = meta;
         trackInfo->mStream = mAudioStream;
         trackInfo->mQueue  = mAudioQ;
+        trackInfo->mLock   = new Mutex;
         trackInfo->mSeek   = false;
+        trackInfo->mSeekCovered = false;
+        trackInfo->mKeyOnly     = false;
+        trackInfo->mReplayTs    = AV_NOPTS_VALUE;
+        trackInfo->mStarted     = false;
+        trackInfo->mDiscarded   = false;
+        trackInfo->mResumeTs    = AV_NOPTS_VALUE;
+        trackInfo->mSkipUntilTs = AV_NOPTS_VALUE;
+        trackInfo->mLastTs      = AV_NOPTS_VALUE;
+        trackInfo->mLastQueuedTs = AV_NOPTS_VALUE;
+        trackInfo->mDropUntilTs = AV_NOPTS_VALUE;
+        trackInfo->mMaxPacketSize = 0;
 
         mDefersToCreateAudioTrack = false;
 
@@ -815,20 +1275,58 @@ void FFmpegExtractor::streamComponentClose(int streamIndex)
 int FFmpegExtractor::streamSeek(int trackIndex, int64_t pos,
         MediaTrackHelper::ReadOptions::SeekMode mode)
 {
-    Mutex::Autolock _l(mLock);
+    // Announce the seek before waiting for the demuxer, so that whoever
+    // holds it steps aside, and an older seek still waiting gives up.
+    mRequestedSeekPos = pos;
+    uint32_t generation = ++mSeekRequests;
+    mPendingSeeks++;
 
-    const TrackInfo& track = mTracks.itemAt(trackIndex);
+    Mutex::Autolock _l(mDemuxLock);
+
+    mPendingSeeks--;
+    int ret = doStreamSeek(trackIndex, pos, mode, generation);
+    mSeekCondition.broadcast();
+
+    return ret;
+}
+
+// Called with mDemuxLock held.
+int FFmpegExtractor::doStreamSeek(int trackIndex, int64_t pos,
+        MediaTrackHelper::ReadOptions::SeekMode mode, uint32_t generation)
+{
+    TrackInfo& track = mTracks.editItemAt(trackIndex);
     const char* type = av_get_media_type_string(track.mStream->codecpar->codec_type);
 
-    if (track.mSeek) {
-        // Don't do anything if seeking is already in progress
-        ALOGV("[%s] seek already in progress",
-              av_get_media_type_string(track.mStream->codecpar->codec_type));
+    if (generation != mSeekRequests) {
+        ALOGV("[%s] (seek) superseded by a newer seek", type);
+        abandonSeek(track);
         return NO_SEEK;
     }
 
+    {
+        Mutex::Autolock _t(*track.mLock);
+        bool covered = track.mSeekCovered;
+        track.mSeekCovered = false;
+        if (covered && mode == mLastSeekMode && sameSeekTarget(pos, mLastSeekPos, mode)
+                && ALooper::GetNowUs() - mLastSeekTimeUs < mSeekCoalesceUs) {
+            // the seek of another track already got us there
+            ALOGV("[%s] (seek) coalesced with the previous seek", type);
+            return NO_SEEK;
+        }
+    }
+
     int64_t seekPos = pos, seekMin, seekMax;
     int err;
+    bool cached = false;
+    bool coversNewer = false;
+
+    if (mGopCacheLimit > 0) {
+        stopGopCache();
+        cached = startGopReplay(pos, mode);
+        if (cached) {
+            goto flush;
+        }
+    }
 
     switch (mode) {
         case MediaTrackHelper::ReadOptions::SEEK_PREVIOUS_SYNC:
@@ -851,8 +1349,26 @@ int FFmpegExtractor::streamSeek(int trackIndex, int64_t pos,
             TRESPASS();
     }
 
+    mSeekServing = generation;
+    mSeeking = true;
     err = avformat_seek_file(mFormatCtx, -1, seekMin, seekPos, seekMax, 0);
-    if (err < 0) {
+    mSeeking = false;
+    // avformat_seek_file() may complete without reading anything, and
+    // then nothing interrupts it; let the newer request coalesce with it.
+    if (err >= 0 && generation != mSeekRequests
+            && sameSeekTarget(mRequestedSeekPos, pos, mode)) {
+        ALOGV("[%s] (seek) superseded, but covers the newer seek", type);
+        coversNewer = true;
+    }
+    if (err < 0 && generation != mSeekRequests) {
+        // interrupted, the newer seek repositions everything
+        ALOGV("[%s] (seek) interrupted by a newer seek", type);
+        if (mFormatCtx->pb) {
+            mFormatCtx->pb->error = 0;
+        }
+        abandonSeek(track);
+        return NO_SEEK;
+    } else if (err < 0) {
         ALOGE("[%s] seek failed(%s (%08x)), restarting at the beginning",
               type, av_err2str(err), err);
         err = avformat_seek_file(mFormatCtx, -1, 0, 0, 0, 0);
@@ -865,22 +1381,127 @@ int FFmpegExtractor::streamSeek(int trackIndex, int64_t pos,
     ALOGV("[%s] (seek) pos=%" PRId64 ", min=%" PRId64 ", max=%" PRId64,
           type, seekPos, seekMin, seekMax);
 
+flush:
+    mLastSeekPos = pos;
+    mLastSeekMode = mode;
+    mLastSeekTimeUs = ALooper::GetNowUs();
+
     mEOF = false;
     for (int i = 0; i < mTracks.size(); i++) {
         TrackInfo& ti = mTracks.editItemAt(i);
+        Mutex::Autolock _t(*ti.mLock);
         packet_queue_flush(ti.mQueue);
+        ti.mLastQueuedTs = AV_NOPTS_VALUE;
+        ti.mDropUntilTs = AV_NOPTS_VALUE;
         ti.mSeek = true;
+        ti.mSeekCovered = i != trackIndex || coversNewer;
+        ti.mResumeTs = AV_NOPTS_VALUE;
+        ti.mSkipUntilTs = AV_NOPTS_VALUE;
+        // let the demuxer skip what getPacket() would drop anyway
+        if (mSeekSkipNonKey && !ti.mDiscarded && !cached) {
+            ti.mStream->discard = AVDISCARD_NONKEY;
+        }
+    }
+    mReaderCondition.signal();
+
+    return SEEK;
+}
+
+/* Trick play step: the demuxer position is shared, so the other tracks keep
+ * what they have queued, and drop what is demuxed again. */
+int FFmpegExtractor::trackSeek(int trackIndex, int64_t pos,
+        MediaTrackHelper::ReadOptions::SeekMode mode)
+{
+    Mutex::Autolock _l(mDemuxLock);
+
+    const char* type = av_get_media_type_string(
+            mTracks.itemAt(trackIndex).mStream->codecpar->codec_type);
+    bool next = mode == MediaTrackHelper::ReadOptions::SEEK_NEXT_SYNC;
+    int err;
+
+    if (mGopCacheLimit > 0) {
+        stopGopCache();
     }
 
+    mSeekServing = mSeekRequests;
+    mSeeking = true;
+    err = avformat_seek_file(mFormatCtx, -1, next ? pos : 0, pos, next ? INT64_MAX : pos, 0);
+    mSeeking = false;
+    if (err < 0) {
+        ALOGE("[%s] (trick play) seek failed(%s (%08x))", type, av_err2str(err), err);
+        if (mFormatCtx->pb) {
+            mFormatCtx->pb->error = 0;
+        }
+        return NO_SEEK;
+    }
+
+    mEOF = false;
+    for (int i = 0; i < mTracks.size(); i++) {
+        TrackInfo& ti = mTracks.editItemAt(i);
+        Mutex::Autolock _t(*ti.mLock);
+        if (i == trackIndex) {
+            packet_queue_flush(ti.mQueue);
+            ti.mLastQueuedTs = AV_NOPTS_VALUE;
+            ti.mDropUntilTs = AV_NOPTS_VALUE;
+            ti.mSeek = true;
+            ti.mResumeTs = AV_NOPTS_VALUE;
+            ti.mSkipUntilTs = AV_NOPTS_VALUE;
+        } else if (ti.mLastQueuedTs != AV_NOPTS_VALUE) {
+            ti.mDropUntilTs = ti.mLastQueuedTs;
+        }
+    }
+    mReaderCondition.signal();
+
     return SEEK;
 }
 
+/* Whether a seek to a lands where a seek to b would: the seeks of the
+ * tracks for one request, or positions with the same key frame. */
+bool FFmpegExtractor::sameSeekTarget(int64_t a, int64_t b,
+        MediaTrackHelper::ReadOptions::SeekMode mode)
+{
+    if (llabs(a - b) <= SEEK_COALESCE_POS_US) {
+        return true;
+    }
+    if (mode == MediaTrackHelper::ReadOptions::SEEK_CLOSEST_SYNC) {
+        return false;
+    }
+
+    int idx = av_find_default_stream_index(mFormatCtx);
+    if (idx < 0) {
+        return false;
+    }
+    AVStream *st = mFormatCtx->streams[idx];
+    int flags = mode == MediaTrackHelper::ReadOptions::SEEK_NEXT_SYNC ? 0 : AVSEEK_FLAG_BACKWARD;
+    int ia = av_index_search_timestamp(st, av_rescale_q(a, AV_TIME_BASE_Q, st->time_base), flags);
+    int ib = av_index_search_timestamp(st, av_rescale_q(b, AV_TIME_BASE_Q, st->time_base), flags);
+    return ia >= 0 && ia == ib;
+}
+
+/* A superseded seek: what the track has queued is from before it, and must
+ * not be returned until the newer seek flushes it. */
+void FFmpegExtractor::abandonSeek(TrackInfo& track)
+{
+    Mutex::Autolock _t(*track.mLock);
+    packet_queue_flush(track.mQueue);
+    track.mLastQueuedTs = AV_NOPTS_VALUE;
+    track.mSeek = true;
+}
+
 int FFmpegExtractor::decodeInterruptCb(void *ctx)
 {
     FFmpegExtractor *extractor = static_cast<FFmpegExtractor *>(ctx);
     return extractor->mAbortRequest;
 }
 
+/* Also gives up on a seek as soon as a newer one is requested */
+int FFmpegExtractor::demuxInterruptCb(void *ctx)
+{
+    FFmpegExtractor *extractor = static_cast<FFmpegExtractor *>(ctx);
+    return extractor->mAbortRequest
+            || (extractor->mSeeking && extractor->mSeekServing != extractor->mSeekRequests);
+}
+
 void FFmpegExtractor::fetchStuffsFromSniffedMeta(const sp<AMessage> &meta)
 {
     AString url;
@@ -894,6 +1515,27 @@ void FFmpegExtractor::fetchStuffsFromSniffedMeta(const sp<AMessage> &meta)
     memcpy(mFilename, url.c_str(), url.size());
     mFilename[url.size()] = '\0';
 
+    //sniffed context, taken over from the message
+    void *ic = NULL;
+    if (meta->findPointer("extended-extractor-context", &ic) && ic) {
+        int32_t probed = 0;
+        meta->findInt32("extended-extractor-probed", &probed);
+        mFormatCtx = static_cast<AVFormatContext *>(ic);
+        mSniffedProbed = probed;
+        meta->setPointer("extended-extractor-context", NULL);
+    }
+
+    //sidecar cache
+    AString format;
+    int64_t key = 0;
+    if (meta->findInt64("extended-extractor-cache-key", &key)) {
+        mCacheKey = key;
+    }
+    meta->findFloat("extended-extractor-confidence", &mSniffConfidence);
+    if (meta->findString("extended-extractor-format", &format)) {
+        mInputFormat = av_find_input_format(format.c_str());
+    }
+
     //mime
     CHECK(meta->findString("extended-extractor-mime", &mime));
     CHECK(mime.c_str() != NULL);
@@ -935,7 +1577,7 @@ int FFmpegExtractor::initStreams()
 {
     int err = 0;
     int i = 0;
-    int ret = 0, audio_ret = -1, video_ret = -1;
+    int ret = 0;
     AVDictionaryEntry *t = NULL;
     AVDictionary **opts = NULL;
     int orig_nb_streams = 0;
@@ -946,24 +1588,49 @@ int FFmpegExtractor::initStreams()
     wanted_stream[AVMEDIA_TYPE_AUDIO]  = -1;
     wanted_stream[AVMEDIA_TYPE_VIDEO]  = -1;
     AVDictionary *format_opts = NULL, *codec_opts = NULL;
+    int64_t probeSize = property_get_int64("debug.ffmpeg.extractor.probesize", 0);
+    int64_t analyzeDurationMs = property_get_int64("debug.ffmpeg.extractor.analyzeduration-ms", 0);
 
     setFFmpegDefaultOpts();
 
-    mFormatCtx = avformat_alloc_context();
-    if (!mFormatCtx)
-    {
-        ALOGE("oom for alloc avformat context");
-        ret = -1;
-        goto fail;
-    }
-    mFormatCtx->interrupt_callback.callback = decodeInterruptCb;
-    mFormatCtx->interrupt_callback.opaque = this;
-    ALOGV("mFilename: %s", mFilename);
-    err = avformat_open_input(&mFormatCtx, mFilename, NULL, &format_opts);
-    if (err < 0) {
-        ALOGE("avformat_open_input(%s) failed: %s (%08x)", mFilename, av_err2str(err), err);
-        ret = -1;
-        goto fail;
+    if (mFormatCtx) {
+        // Reuse the context opened by the sniffer, with the default probe
+        // size instead of the one the sniffer limits itself to.
+        const AVOption *o = av_opt_find(mFormatCtx, "probesize", NULL, 0, 0);
+        if (probeSize > 0) {
+            mFormatCtx->probesize = probeSize;
+        } else if (o) {
+            mFormatCtx->probesize = o->default_val.i64;
+        }
+        if (analyzeDurationMs > 0) {
+            mFormatCtx->max_analyze_duration = analyzeDurationMs * 1000;
+        }
+        mFormatCtx->interrupt_callback.callback = demuxInterruptCb;
+        mFormatCtx->interrupt_callback.opaque = this;
+        ALOGV("mFilename: %s (sniffed, probed: %d)", mFilename, mSniffedProbed);
+    } else {
+        mFormatCtx = avformat_alloc_context();
+        if (!mFormatCtx)
+        {
+            ALOGE("oom for alloc avformat context");
+            ret = -1;
+            goto fail;
+        }
+        if (probeSize > 0) {
+            mFormatCtx->probesize = probeSize;
+        }
+        if (analyzeDurationMs > 0) {
+            mFormatCtx->max_analyze_duration = analyzeDurationMs * 1000;
+        }
+        mFormatCtx->interrupt_callback.callback = demuxInterruptCb;
+        mFormatCtx->interrupt_callback.opaque = this;
+        ALOGV("mFilename: %s", mFilename);
+        err = ffmpeg_source_open_input(&mFormatCtx, mFilename, mInputFormat, &format_opts);
+        if (err < 0) {
+            ALOGE("avformat_open_input(%s) failed: %s (%08x)", mFilename, av_err2str(err), err);
+            ret = -1;
+            goto fail;
+        }
     }
 
     if ((t = av_dict_get(format_opts, "", NULL, AV_DICT_IGNORE_SUFFIX))) {
@@ -979,18 +1646,40 @@ int FFmpegExtractor::initStreams()
     if (mGenPTS)
         mFormatCtx->flags |= AVFMT_FLAG_GENPTS;
 
-    opts = setup_find_stream_info_opts(mFormatCtx, codec_opts);
-    orig_nb_streams = mFormatCtx->nb_streams;
+    if (!mSniffedProbed && isHeaderComplete(mFormatCtx->iformat)
+            && property_get_bool("debug.ffmpeg.extractor.header-only", 1)) {
+        mStreamInfoFromHeader = mFormatCtx->nb_streams > 0;
+        for (i = 0; i < (int)mFormatCtx->nb_streams; i++) {
+            if (!hasHeaderStreamInfo(mFormatCtx->streams[i])) {
+                ALOGD("[%s] stream %d is not fully described by the header, probing",
+                        av_get_media_type_string(mFormatCtx->streams[i]->codecpar->codec_type), i);
+                mStreamInfoFromHeader = false;
+                break;
+            }
+        }
+        if (mStreamInfoFromHeader) {
+            ALOGV("stream info taken from the %s header", mFormatCtx->iformat->name);
+        }
+    }
+
+    if (!mSniffedProbed && !mStreamInfoFromHeader) {
+        mStreamInfoCached = loadStreamInfo();
+    }
+
+    if (!mSniffedProbed && !mStreamInfoCached && !mStreamInfoFromHeader) {
+        opts = setup_find_stream_info_opts(mFormatCtx, codec_opts);
+        orig_nb_streams = mFormatCtx->nb_streams;
 
-    err = avformat_find_stream_info(mFormatCtx, opts);
-    if (err < 0) {
-        ALOGE("avformat_find_stream_info(%s) failed: %s (%08x)", mFilename, av_err2str(err), err);
-        ret = -1;
-        goto fail;
+        err = avformat_find_stream_info(mFormatCtx, opts);
+        if (err < 0) {
+            ALOGE("avformat_find_stream_info(%s) failed: %s (%08x)", mFilename, av_err2str(err), err);
+            ret = -1;
+            goto fail;
+        }
+        for (i = 0; i < orig_nb_streams; i++)
+            av_dict_free(&opts[i]);
+        av_freep(&opts);
     }
-    for (i = 0; i < orig_nb_streams; i++)
-        av_dict_free(&opts[i]);
-    av_freep(&opts);
 
     if (mFormatCtx->pb)
         mFormatCtx->pb->eof_reached = 0; // FIXME hack, ffplay maybe should not use url_feof() to test for the end
@@ -1015,8 +1704,9 @@ int FFmpegExtractor::initStreams()
         av_dump_format(mFormatCtx, 0, mFilename, 0);
     }
 
+    // the start time is only known after probing
     if (mFormatCtx->duration != AV_NOPTS_VALUE &&
-            mFormatCtx->start_time != AV_NOPTS_VALUE) {
+            (mFormatCtx->start_time != AV_NOPTS_VALUE || mStreamInfoFromHeader)) {
         int hours, mins, secs, us;
 
         ALOGV("file startTime: %" PRId64, mFormatCtx->start_time);
@@ -1033,19 +1723,11 @@ int FFmpegExtractor::initStreams()
             hours, mins, secs, (100 * us) / AV_TIME_BASE);
     }
 
-    if (st_index[AVMEDIA_TYPE_AUDIO] >= 0) {
-        audio_ret = streamComponentOpen(st_index[AVMEDIA_TYPE_AUDIO]);
-        if (audio_ret >= 0)
-            packet_queue_start(mAudioQ);
-    }
-
-    if (st_index[AVMEDIA_TYPE_VIDEO] >= 0) {
-        video_ret = streamComponentOpen(st_index[AVMEDIA_TYPE_VIDEO]);
-        if (video_ret >= 0)
-            packet_queue_start(mVideoQ);
-    }
+    // opened by openTracks(), when packets are needed
+    mSelectedAudioIdx = st_index[AVMEDIA_TYPE_AUDIO];
+    mSelectedVideoIdx = st_index[AVMEDIA_TYPE_VIDEO];
 
-    if (audio_ret < 0 && video_ret < 0) {
+    if (mSelectedAudioIdx < 0 && mSelectedVideoIdx < 0) {
         ALOGE("initStreams(%s) could not find any audio/video", mFilename);
         ret = -1;
         goto fail;
@@ -1059,13 +1741,20 @@ fail:
 
 void FFmpegExtractor::deInitStreams()
 {
+    FFSourceStats stats;
+
+    if (ffmpeg_source_get_stats(mFormatCtx, &stats) && (stats.hits || stats.misses)) {
+        ALOGI("prefetch hits: %" PRId64 ", misses: %" PRId64 ", prefetched: %" PRId64 " bytes",
+              stats.hits, stats.misses, stats.prefetched);
+    }
+
     if (mAudioStreamIdx >= 0)
         streamComponentClose(mAudioStreamIdx);
     if (mVideoStreamIdx >= 0)
         streamComponentClose(mVideoStreamIdx);
 
     if (mFormatCtx) {
-        avformat_close_input(&mFormatCtx);
+        ffmpeg_source_close_input(&mFormatCtx);
     }
 }
 
@@ -1079,6 +1768,12 @@ int FFmpegExtractor::feedNextPacket() {
         return AVERROR_EOF;
     }
 
+    // Serve the packets of a cached GOP after a seek into it
+
+    if (mGopReplay && replayGopPacket(pkt)) {
+        return queuePacket(pkt);
+    }
+
     // Read next frame
 
     ret = av_read_frame(mFormatCtx, pkt);
@@ -1093,6 +1788,33 @@ int FFmpegExtractor::feedNextPacket() {
     }
     mPktCounter++;
 
+    if (skipReplayedPacket(pkt)) {
+        av_packet_unref(pkt);
+        return AVERROR(EAGAIN);
+    }
+
+    if (pkt->stream_index == mIndexStreamIdx && (pkt->flags & AV_PKT_FLAG_KEY)) {
+        addIndexEntry(pkt->pos, pkt->dts != AV_NOPTS_VALUE ? pkt->dts : pkt->pts,
+                &mLastIndexedTs);
+    }
+
+    // Waiting for the sync sample after a seek. Not all demuxers honor
+    // AVDISCARD_NONKEY, drop what they still return before queueing it.
+    // Trick play keeps discarding them.
+    AVStream *st = mFormatCtx->streams[pkt->stream_index];
+    if (st->discard == AVDISCARD_NONKEY) {
+        TrackInfo *ti = findTrack(pkt->stream_index);
+        if (!(pkt->flags & AV_PKT_FLAG_KEY)) {
+            av_packet_unref(pkt);
+            return AVERROR(EAGAIN);
+        }
+        if (!ti || !ti->mKeyOnly) {
+            ALOGV("[%s] (seek) key packet read, no longer discarding non key packets",
+                  av_get_media_type_string(st->codecpar->codec_type));
+            st->discard = AVDISCARD_DEFAULT;
+        }
+    }
+
 #if DEBUG_PKT
     ALOGV("next packet [%d] pts=%" PRId64 ", dts=%" PRId64 ", size=%d",
           pkt->stream_index, pkt->pts, pkt->dts, pkt->size);
@@ -1103,122 +1825,1669 @@ int FFmpegExtractor::feedNextPacket() {
     if (pkt->stream_index == mVideoStreamIdx) {
          if (mDefersToCreateVideoTrack) {
             AVCodecParameters *avpar = mFormatCtx->streams[mVideoStreamIdx]->codecpar;
-            int i = parser_split(avpar, pkt->data, pkt->size);
 
-            if (i > 0 && i < FF_MAX_EXTRADATA_SIZE) {
-                if (avpar->extradata) {
-                    av_freep(&avpar->extradata);
-                }
-                avpar->extradata_size = i;
-                avpar->extradata = (uint8_t *)av_malloc(avpar->extradata_size + AV_INPUT_BUFFER_PADDING_SIZE);
-                if (avpar->extradata) {
-                    // sps + pps(there may be sei in it)
-                    memcpy(avpar->extradata, pkt->data, avpar->extradata_size);
-                    memset(avpar->extradata + i, 0, AV_INPUT_BUFFER_PADDING_SIZE);
-                } else {
-                    ALOGE("[video] failed to allocate new extradata");
-                    return AVERROR(ENOMEM);
+            ret = extractVideoExtradata(avpar, pkt);
+            if (ret < 0) {
+                // not decodable without it anyway
+                av_packet_unref(pkt);
+                return ret;
+            }
+            av_bsf_free(&mVideoBsfc);
+
+            streamComponentOpen(mVideoStreamIdx);
+            if (!mDefersToCreateVideoTrack) {
+                ALOGI("[video] probe packet counter: %zu when track created", mPktCounter);
+            }
+        }
+    } else if (pkt->stream_index == mAudioStreamIdx) {
+        AVCodecParameters *avpar = mFormatCtx->streams[mAudioStreamIdx]->codecpar;
+
+        if (mAudioBsfc && pkt->data) {
+            ret = av_bsf_send_packet(mAudioBsfc, pkt);
+            if (ret < 0) {
+                ALOGE("[audio::%s] failed to send packet to filter, err = %d", mAudioBsfc->filter->name, ret);
+                av_packet_unref(pkt);
+                return ret;
+            }
+            ret = av_bsf_receive_packet(mAudioBsfc, pkt);
+            if (ret < 0) {
+                ALOGE_IF(ret != AVERROR(EAGAIN), "[audio::%s] failed to received packet from filter, err=%d",
+                         mAudioBsfc->filter->name, ret);
+                av_packet_unref(pkt);
+                return ret;
+            }
+            if (mDefersToCreateAudioTrack && avpar->extradata_size <= 0) {
+                size_t new_extradata_size = 0;
+                uint8_t* new_extradata = av_packet_get_side_data(pkt, AV_PKT_DATA_NEW_EXTRADATA, &new_extradata_size);
+
+                if (new_extradata_size > 0) {
+                    ALOGV("[audio::%s] extradata found, len=%zd", mAudioBsfc->filter->name, new_extradata_size);
+                    avpar->extradata = (uint8_t*)av_mallocz(new_extradata_size + AV_INPUT_BUFFER_PADDING_SIZE);
+                    if (avpar->extradata) {
+                        memcpy(avpar->extradata, new_extradata, new_extradata_size);
+                        avpar->extradata_size = new_extradata_size;
+                    } else {
+                        ALOGE("[audio::%s] failed to allocate new extradata", mAudioBsfc->filter->name);
+                        return AVERROR(ENOMEM);
+                    }
                 }
-            } else {
+            }
+        }
+
+        if (mDefersToCreateAudioTrack) {
+            if (avpar->extradata_size <= 0) {
                 av_packet_unref(pkt);
                 return AVERROR(EAGAIN);
             }
+            streamComponentOpen(mAudioStreamIdx);
+            if (!mDefersToCreateAudioTrack) {
+                ALOGI("[audio] probe packet counter: %zu when track created", mPktCounter);
+            }
+        }
+    }
+
+    recordGopPacket(pkt);
+
+    return queuePacket(pkt);
+}
+
+// Called with mDemuxLock held.
+int FFmpegExtractor::queuePacket(AVPacket *pkt) {
+    TrackInfo *track = findTrack(pkt->stream_index);
+    int64_t ts = track ? packetTimeUs(pkt, track->mStream) : AV_NOPTS_VALUE;
+
+    if (track && track->mDropUntilTs != AV_NOPTS_VALUE) {
+        // demuxed again after resuming another track, already queued
+        if (ts != AV_NOPTS_VALUE && ts <= track->mDropUntilTs) {
+            av_packet_unref(pkt);
+            return AVERROR(EAGAIN);
+        }
+        track->mDropUntilTs = AV_NOPTS_VALUE;
+    }
+
+    if (!checkQueueBudget(pkt)) {
+        av_packet_unref(pkt);
+        return AVERROR(EAGAIN);
+    }
+
+    if (track) {
+        if (ts != AV_NOPTS_VALUE) {
+            track->mLastQueuedTs = ts;
+        }
+        if (pkt->size > track->mMaxPacketSize) {
+            track->mMaxPacketSize = pkt->size;
+        }
+    }
+
+    // Recycle the payloads of small packets, most of them, instead of
+    // having a buffer allocated and freed for each. The copy is cheap at
+    // these sizes, and leaves a buffer that can be converted in place.
+    if (mPacketPool && pkt->size <= mPoolCopyMax) {
+        packet_pool_adopt(mPacketPool, pkt);
+    }
+
+    if (pkt->stream_index == mVideoStreamIdx) {
+        packet_queue_put(mVideoQ, pkt);
+        return mVideoStreamIdx;
+    } else if (pkt->stream_index == mAudioStreamIdx) {
+        packet_queue_put(mAudioQ, pkt);
+        return mAudioStreamIdx;
+    } else {
+        av_packet_unref(pkt);
+        return AVERROR(EAGAIN);
+    }
+}
+
+int FFmpegExtractor::getPacket(int trackIndex, AVPacket *pkt) {
+    TrackInfo& track = mTracks.editItemAt(trackIndex);
+    const char* type = av_get_media_type_string(track.mStream->codecpar->codec_type);
+    int err;
+
+    while (true) {
+        // Fast path: only the track lock is needed to pop a queued packet,
+        // so this never waits behind demuxer I/O done for another track.
+        {
+            Mutex::Autolock _t(*track.mLock);
+
+            err = packet_queue_get(track.mQueue, pkt, 0);
+            if (err > 0) {
+                int64_t ts = packetTimeUs(pkt, track.mStream);
+
+                if (track.mSkipUntilTs != AV_NOPTS_VALUE) {
+                    // resumed after dropping, skip what was already returned
+                    if (ts != AV_NOPTS_VALUE && ts < track.mSkipUntilTs) {
+                        av_packet_unref(pkt);
+                        continue;
+                    }
+                    track.mSkipUntilTs = AV_NOPTS_VALUE;
+                }
+                if (track.mKeyOnly && (pkt->flags & AV_PKT_FLAG_KEY) == 0) {
+                    // queued before trick play started
+                    av_packet_unref(pkt);
+                    continue;
+                }
+                if (track.mSeek && (pkt->flags & AV_PKT_FLAG_KEY) != 0) {
+                    ALOGV("[%s] (seek) key frame found @ ts=%" PRId64,
+                          type, pkt->pts != AV_NOPTS_VALUE ? av_rescale_q(pkt->pts, track.mStream->time_base, AV_TIME_BASE_Q) : -1);
+                    track.mSeek = false;
+                }
+                if (! track.mSeek) {
+                    if (ts != AV_NOPTS_VALUE) {
+                        track.mLastTs = ts;
+                    }
+                    track.mSeekCovered = false;
+                    if (mReaderThreadStarted
+                            && packet_queue_nb_packets(track.mQueue) < MIN_FRAMES) {
+                        mReaderCondition.signal();
+                    }
+                    return 0;
+                }
+                ALOGV("[%s] (seek) drop non key frame", type);
+                av_packet_unref(pkt);
+                continue;
+            } else if (err < 0) {
+                return AVERROR_UNKNOWN;
+            }
+        }
+
+        // Slow path: the queue is empty, go through the demuxer.
+        Mutex::Autolock _l(mDemuxLock);
+
+        if (waitForPendingSeeks()) {
+            // the queue was flushed, or filled in the meantime
+            continue;
+        }
+
+        if (packet_queue_nb_packets(track.mQueue) > 0) {
+            // filled while we were waiting for the demuxer
+            continue;
+        }
+
+        if (track.mResumeTs != AV_NOPTS_VALUE) {
+            // we dropped packets of this track to stay within the budget
+            resumeDroppedTrack(track);
+            continue;
+        }
+
+        if (mReaderThreadStarted) {
+            // The reader thread owns the demuxer, wait for it to queue
+            // something for us.
+            if (mEOF || mAbortRequest) {
+                return AVERROR_EOF;
+            }
+            mWaitingForData++;
+            mReaderCondition.signal();
+            mDataCondition.wait(mDemuxLock);
+            mWaitingForData--;
+        } else {
+            err = feedNextPacket();
+            if (err < 0 && err != AVERROR(EAGAIN)) {
+                return err;
+            }
+        }
+    }
+}
+
+// Called with mDemuxLock held, lets the seeks waiting for the demuxer go
+// first, instead of demuxing packets they will flush. Returns true if it
+// had to wait.
+bool FFmpegExtractor::waitForPendingSeeks() {
+    bool waited = false;
+
+    while (mPendingSeeks > 0 && !mAbortRequest) {
+        mSeekCondition.wait(mDemuxLock);
+        waited = true;
+    }
+    return waited;
+}
+
+void *FFmpegExtractor::ReaderWrapper(void *me) {
+    ((FFmpegExtractor *)me)->readerEntry();
+    return NULL;
+}
+
+/* Keep the packet queues between the MIN_FRAMES and MAX_FRAMES watermarks,
+ * so that FFmpegSource::read() does not have to wait for the demuxer. */
+void FFmpegExtractor::readerEntry() {
+    int err;
+
+    prctl(PR_SET_NAME, (unsigned long)"FFmpegReader", 0, 0, 0);
+
+    ALOGV("FFmpegReader enter");
+
+    Mutex::Autolock _l(mDemuxLock);
+
+    while (!mAbortRequest) {
+        if (waitForPendingSeeks()) {
+            continue;
+        }
+        if (mEOF || !needsMorePackets()) {
+            mReaderCondition.wait(mDemuxLock);
+            continue;
+        }
+
+        err = feedNextPacket();
+        if (err != AVERROR(EAGAIN)) {
+            mDataCondition.broadcast();
+        }
+    }
+
+    ALOGV("FFmpegReader exit");
+}
+
+// Called with mDemuxLock held.
+bool FFmpegExtractor::needsMorePackets() {
+    bool low = false;
+    bool high = true;
+
+    if (mWaitingForData > 0) {
+        return true;
+    }
+    if (mThumbnailMode) {
+        // a single frame is wanted, do not read ahead of it
+        return false;
+    }
+
+    for (size_t i = 0; i < mTracks.size(); ++i) {
+        const TrackInfo& ti = mTracks.itemAt(i);
+        int nb_packets = packet_queue_nb_packets(ti.mQueue);
+
+        if (ti.mDiscarded || ti.mResumeTs != AV_NOPTS_VALUE)
+            continue;
+        if (nb_packets < MIN_FRAMES)
+            low = true;
+        if (nb_packets < MAX_FRAMES)
+            high = false;
+    }
+
+    if (isOverBudget(0)) {
+        mReadAhead = false;
+    } else if (low) {
+        mReadAhead = true;
+    } else if (high) {
+        mReadAhead = false;
+    }
+
+    return mReadAhead;
+}
+
+void FFmpegExtractor::initQueueBudget()
+{
+    char value[PROPERTY_VALUE_MAX];
+    bool lowRam = property_get_bool("ro.config.low_ram", 0);
+
+    mMaxQueueBytes = property_get_int32("debug.ffmpeg.extractor.max-queue-bytes",
+            lowRam ? LOW_RAM_MAX_QUEUE_SIZE : MAX_QUEUE_SIZE);
+    mMaxQueuePackets = property_get_int32("debug.ffmpeg.extractor.max-queue-packets",
+            MAX_QUEUE_PACKETS);
+
+    property_get("debug.ffmpeg.extractor.budget-policy", value, "discard");
+    if (!strcmp(value, "block")) {
+        mBudgetPolicy = BUDGET_POLICY_BLOCK;
+    } else if (!strcmp(value, "drop")) {
+        mBudgetPolicy = BUDGET_POLICY_DROP;
+    } else {
+        if (strcmp(value, "discard")) {
+            ALOGE("unsupported budget policy: %s", value);
+        }
+        mBudgetPolicy = BUDGET_POLICY_DISCARD;
+    }
+
+    ALOGV("queue budget: %d bytes, %d packets, policy: %s",
+          mMaxQueueBytes, mMaxQueuePackets, value);
+}
+
+FFmpegExtractor::TrackInfo *FFmpegExtractor::findTrack(int streamIndex)
+{
+    for (size_t i = 0; i < mTracks.size(); ++i) {
+        if (mTracks.itemAt(i).mIndex == streamIndex) {
+            return &mTracks.editItemAt(i);
+        }
+    }
+    return NULL;
+}
+
+/* Size the buffer group of a track for its largest expected packet, so that
+ * keyframes do not force reallocations, with several buffers in flight.
+ * The group preallocates its buffers, so only a few are, and it grows up to
+ * growthLimit when more are in flight. */
+void FFmpegExtractor::getBufferGroupSize(size_t trackIndex, bool zeroCopy,
+        size_t *buffers, size_t *bufferSize, size_t *growthLimit)
+{
+    Mutex::Autolock autoLock(mDemuxLock);
+
+    const TrackInfo& track = mTracks.itemAt(trackIndex);
+    const AVCodecParameters *avpar = track.mStream->codecpar;
+    int64_t size = MIN_BUFFER_SIZE;
+
+    if (avpar->codec_type == AVMEDIA_TYPE_VIDEO) {
+        int64_t width = avpar->width > 0 ? avpar->width : 1920;
+        int64_t height = avpar->height > 0 ? avpar->height : 1088;
+        AVRational fps = track.mStream->avg_frame_rate;
+        const AVCodecDescriptor *desc = avcodec_descriptor_get(avpar->codec_id);
+
+        // A yuv420 picture, compressed at least 2:1 unless the codec is
+        // lossless or intra-only (as done by the stock codecs).
+        size = width * height * 3 / 2;
+        if (!desc || !(desc->props & (AV_CODEC_PROP_LOSSLESS | AV_CODEC_PROP_INTRA_ONLY))) {
+            size /= 2;
+            // keyframes are typically up to 8 times the average frame
+            if (avpar->bit_rate > 0 && fps.num > 0 && fps.den > 0) {
+                int64_t avg = av_rescale(avpar->bit_rate / 8, fps.den, fps.num);
+                size = FFMIN(size, FFMAX(avg * 8, (int64_t)64 * 1024));
+            }
+        }
+        *buffers = VIDEO_BUFFERS;
+    } else {
+        if (avpar->block_align > 0) {
+            // raw demuxers read 1024 blocks at once
+            size = FFMAX(size, (int64_t)avpar->block_align * 1024);
+        }
+        if (avpar->bit_rate > 0 && avpar->frame_size > 0 && avpar->sample_rate > 0) {
+            size = FFMAX(size, av_rescale(avpar->bit_rate / 8,
+                    avpar->frame_size * 2, avpar->sample_rate));
+        }
+        *buffers = AUDIO_BUFFERS;
+    }
+
+    size = FFMAX(size, (int64_t)track.mMaxPacketSize);
+    size = FFMIN(size + AV_INPUT_BUFFER_PADDING_SIZE, (int64_t)MAX_BUFFER_SIZE);
+    *bufferSize = FFALIGN(size, 4096);
+    *growthLimit = *buffers * 4;
+
+    if (zeroCopy) {
+        // packets are wrapped, the group only backs the few that are copied
+        *buffers = 1;
+        *bufferSize = MIN_BUFFER_SIZE;
+    } else {
+        *buffers = FFMAX(FFMIN(*buffers, MAX_PREALLOCATED_SIZE / *bufferSize), (size_t)1);
+    }
+
+    ALOGV("[%s] buffer group: %zu x %zu bytes (max packet: %d)",
+          av_get_media_type_string(avpar->codec_type), *buffers, *bufferSize,
+          track.mMaxPacketSize);
+}
+
+bool FFmpegExtractor::isOverBudget(int extraBytes)
+{
+    int size = extraBytes;
+    int nb_packets = 0;
+
+    for (size_t i = 0; i < mTracks.size(); ++i) {
+        PacketQueue *q = mTracks.itemAt(i).mQueue;
+        size += packet_queue_size(q);
+        nb_packets += packet_queue_nb_packets(q);
+    }
+
+    return size > mMaxQueueBytes || nb_packets >= mMaxQueuePackets;
+}
+
+// Called with mDemuxLock held, before queueing pkt. Returns false if the
+// packet must be dropped.
+bool FFmpegExtractor::checkQueueBudget(AVPacket *pkt)
+{
+    TrackInfo *track = findTrack(pkt->stream_index);
+    bool anyStarted = false;
+
+    if (track == NULL) {
+        // deferred track creation in progress
+        return true;
+    }
+
+    if (track->mResumeTs != AV_NOPTS_VALUE) {
+        // keep dropping until the track gets read again
+        return false;
+    }
+
+    if (!isOverBudget(pkt->size)) {
+        return true;
+    }
+
+    for (size_t i = 0; i < mTracks.size(); ++i) {
+        anyStarted |= mTracks.itemAt(i).mStarted;
+    }
+
+    // Nobody reads yet (e.g. probing), or blocking is handled by the reader
+    // thread not reading ahead anymore.
+    if (!anyStarted || (mBudgetPolicy == BUDGET_POLICY_BLOCK && mReaderThreadStarted)) {
+        return true;
+    }
+
+    // Demuxing on demand, reading a track queues everything the others did
+    // not consume, and blocking cannot bound that: discard the streams not
+    // started, and drop from started ones that are not read.
+    if (mBudgetPolicy == BUDGET_POLICY_DISCARD || mBudgetPolicy == BUDGET_POLICY_BLOCK) {
+        for (size_t i = 0; i < mTracks.size(); ++i) {
+            TrackInfo& ti = mTracks.editItemAt(i);
+            if (ti.mStarted || ti.mDiscarded) {
+                continue;
+            }
+            ALOGI("[%s] over budget, discarding stream until it is started",
+                  av_get_media_type_string(ti.mStream->codecpar->codec_type));
+            Mutex::Autolock _t(*ti.mLock);
+            ti.mStream->discard = AVDISCARD_ALL;
+            ti.mDiscarded = true;
+            packet_queue_flush(ti.mQueue);
+            ti.mLastQueuedTs = AV_NOPTS_VALUE;
+        }
+        if (mBudgetPolicy == BUDGET_POLICY_DISCARD || track->mDiscarded
+                || !isOverBudget(pkt->size)) {
+            return !track->mDiscarded;
+        }
+    }
+
+    // BUDGET_POLICY_DROP: drop the packets of the fullest queue
+    TrackInfo *victim = NULL;
+    int victimSize = -1;
+    for (size_t i = 0; i < mTracks.size(); ++i) {
+        TrackInfo& ti = mTracks.editItemAt(i);
+        int size = packet_queue_size(ti.mQueue);
+        if (size > victimSize) {
+            victim = &ti;
+            victimSize = size;
+        }
+    }
+    if (victim != track && victimSize > 0) {
+        // Make room: the victim gives up what it has queued, and demuxes it
+        // again once it is read.
+        AVPacket first;
+        Mutex::Autolock _t(*victim->mLock);
+        if (packet_queue_get(victim->mQueue, &first, 0) > 0) {
+            int64_t ts = packetTimeUs(&first, victim->mStream);
+            av_packet_unref(&first);
+            if (ts != AV_NOPTS_VALUE) {
+                victim->mResumeTs = ts;
+            } else if (victim->mResumeTs == AV_NOPTS_VALUE) {
+                victim->mResumeTs = victim->mLastTs != AV_NOPTS_VALUE ? victim->mLastTs : 0;
+            }
+            packet_queue_flush(victim->mQueue);
+            victim->mLastQueuedTs = AV_NOPTS_VALUE;
+            ALOGI("[%s] over budget, dropping queued packets from %" PRId64,
+                  av_get_media_type_string(victim->mStream->codecpar->codec_type),
+                  victim->mResumeTs);
+        }
+    }
+    if (victim != track && !isOverBudget(pkt->size)) {
+        return true;
+    }
+
+    // still no room, whatever track the packet is for
+    track->mResumeTs = packetTimeUs(pkt, track->mStream);
+    ALOGI("[%s] over budget, dropping packets from %" PRId64,
+          av_get_media_type_string(track->mStream->codecpar->codec_type), track->mResumeTs);
+    if (track->mResumeTs == AV_NOPTS_VALUE) {
+        // nowhere to resume from, fall back to the last returned packet
+        track->mResumeTs = track->mLastTs != AV_NOPTS_VALUE ? track->mLastTs : 0;
+    }
+    return false;
+}
+
+// Called with mDemuxLock held, when a track whose packets were dropped
+// has consumed everything that was queued before the drop. The demuxer has
+// to go back to the first dropped packet, which re-reads everything since
+// then; the packets the other tracks already have are dropped as they are
+// demuxed again, and their queues are kept.
+void FFmpegExtractor::resumeDroppedTrack(TrackInfo& track)
+{
+    int64_t resumeTs = track.mResumeTs;
+    const char* type = av_get_media_type_string(track.mStream->codecpar->codec_type);
+    int err;
+
+    track.mResumeTs = AV_NOPTS_VALUE;
+
+    ALOGI("[%s] resuming dropped packets @ %" PRId64, type, resumeTs);
+
+    if (mGopCacheLimit > 0) {
+        stopGopCache();
+    }
+
+    err = avformat_seek_file(mFormatCtx, -1, INT64_MIN, resumeTs, resumeTs, 0);
+    if (err < 0) {
+        ALOGE("[%s] resume failed(%s (%08x)), skipping dropped packets",
+              type, av_err2str(err), err);
+        return;
+    }
+
+    // The seek lands on or before the first dropped packet, skip whatever
+    // each track already got.
+    mEOF = false;
+    for (size_t i = 0; i < mTracks.size(); ++i) {
+        TrackInfo& ti = mTracks.editItemAt(i);
+        Mutex::Autolock _t(*ti.mLock);
+        if (&ti == &track) {
+            packet_queue_flush(ti.mQueue);
+            ti.mSkipUntilTs = resumeTs;
+        } else if (ti.mLastQueuedTs != AV_NOPTS_VALUE) {
+            ti.mDropUntilTs = ti.mLastQueuedTs;
+        } else if (ti.mLastTs != AV_NOPTS_VALUE) {
+            ti.mDropUntilTs = ti.mLastTs;
+        }
+    }
+    mReaderCondition.signal();
+}
+
+void FFmpegExtractor::setTrackStarted(size_t trackIndex, bool started)
+{
+    Mutex::Autolock _l(mDemuxLock);
+    TrackInfo& track = mTracks.editItemAt(trackIndex);
+
+    // only playback needs seeking to be fast
+    if (started && !mIndexInitialized) {
+        mIndexInitialized = true;
+        initKeyframeIndex();
+    }
+
+    track.mStarted = started;
+    if (!started && track.mIndex == mVideoStreamIdx && mThumbnailMode) {
+        ALOGV("thumbnail mode over");
+        mThumbnailMode = false;
+    }
+    if (started && track.mDiscarded) {
+        ALOGI("[%s] track started, no longer discarding stream",
+              av_get_media_type_string(track.mStream->codecpar->codec_type));
+        Mutex::Autolock _t(*track.mLock);
+        track.mStream->discard = mSeekSkipNonKey || track.mKeyOnly
+                ? AVDISCARD_NONKEY : AVDISCARD_DEFAULT;
+        track.mDiscarded = false;
+        track.mSeek = true;
+    }
+}
+
+/* Called when a thumbnail is to be extracted from the video track: stop
+ * demuxing the other streams, skip up to the next key packet, and return
+ * the time of a representative key frame near the given time. */
+int64_t FFmpegExtractor::enterThumbnailMode(size_t trackIndex, int64_t timeUs)
+{
+    Mutex::Autolock _l(mDemuxLock);
+    TrackInfo& video = mTracks.editItemAt(trackIndex);
+
+    if (!mThumbnailMode) {
+        ALOGV("thumbnail mode");
+        mThumbnailMode = true;
+
+        for (size_t i = 0; i < mTracks.size(); ++i) {
+            TrackInfo& ti = mTracks.editItemAt(i);
+            if (i == trackIndex || ti.mStarted || ti.mDiscarded) {
+                continue;
+            }
+            Mutex::Autolock _t(*ti.mLock);
+            ti.mStream->discard = AVDISCARD_ALL;
+            ti.mDiscarded = true;
+            packet_queue_flush(ti.mQueue);
+            ti.mLastQueuedTs = AV_NOPTS_VALUE;
+        }
+        for (unsigned int i = 0; i < mFormatCtx->nb_streams; ++i) {
+            if ((int)i != mVideoStreamIdx) {
+                mFormatCtx->streams[i]->discard = AVDISCARD_ALL;
+            }
+        }
+
+        // Until the first key packet only: the retriever may want the
+        // frames that follow to reach a non sync target.
+        if (!video.mDiscarded) {
+            video.mStream->discard = AVDISCARD_NONKEY;
+        }
+    }
+
+    // The persistent index is otherwise only loaded once playback starts,
+    // and is all there is for the containers without a seek index.
+    AVStream *stream = video.mStream;
+    if (mCacheKey && !mIndexInitialized && mIndexStreamIdx < 0
+            && av_find_default_stream_index(mFormatCtx) == mVideoStreamIdx
+            && !hasUsableIndex(stream)) {
+        mIndexStreamIdx = mVideoStreamIdx;
+        loadKeyframeIndex();
+    }
+
+    // Prefer the largest key frame around the time, a black or flat
+    // picture compresses to a small one.
+    int count = avformat_index_get_entries_count(stream);
+    int64_t window = mFormatCtx->duration / 10;
+    int64_t bestTime = timeUs;
+    int bestSize = 0;
+
+    for (int i = 0; i < count; ++i) {
+        const AVIndexEntry *e = avformat_index_get_entry(stream, i);
+        if (!(e->flags & AVINDEX_KEYFRAME)) {
+            continue;
+        }
+        int64_t t = av_rescale_q(e->timestamp, stream->time_base, AV_TIME_BASE_Q);
+        if (t < timeUs - window) {
+            continue;
+        }
+        if (t > timeUs + window) {
+            break;
+        }
+        // indexed while demuxing, only the position is known
+        int size = e->size;
+        if (!size && i + 1 < count) {
+            size = FFMIN(avformat_index_get_entry(stream, i + 1)->pos - e->pos, INT_MAX);
+        }
+        if (size > bestSize) {
+            bestSize = size;
+            bestTime = t;
+        }
+    }
+
+    ALOGV("thumbnail time: %" PRId64 " (key frame of %d bytes)", bestTime, bestSize);
+    return bestTime;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// GOP cache
+//
+// Keeps the packets of the GOPs demuxed last, so that seeking back into them
+// does not hit the data source again. A run is a sequence of segments that
+// were demuxed one after the other, each segment starting at a video key
+// packet. A seek into a run replays it, then the demuxer resumes right after
+// its last packet.
+
+// Called with mDemuxLock held.
+void FFmpegExtractor::recordGopPacket(AVPacket *pkt)
+{
+    if (mGopCacheLimit <= 0 || mGopReplay) {
+        return;
+    }
+    if (pkt->stream_index != mVideoStreamIdx && pkt->stream_index != mAudioStreamIdx) {
+        return;
+    }
+
+    int64_t ts = packetTimeUs(pkt, mFormatCtx->streams[pkt->stream_index]);
+
+    if (pkt->stream_index == mVideoStreamIdx && (pkt->flags & AV_PKT_FLAG_KEY)
+            && ts != AV_NOPTS_VALUE) {
+        // demuxed again, the new copy replaces the cached one
+        for (size_t i = 0; i < mGopCache.size(); ++i) {
+            if (mGopCache.itemAt(i)->mKeyTs == ts) {
+                removeGopSegment(i);
+                break;
+            }
+        }
+
+        GopSegment *seg = new GopSegment;
+        seg->mKeyTs = ts;
+        seg->mLastTs = ts;
+        seg->mRun = mGopRun;
+        seg->mSeq = mGopSeq++;
+        seg->mBytes = 0;
+        mGopCache.push_back(seg);
+        mGopRecording = seg;
+    }
+
+    if (!mGopRecording) {
+        // nothing to replay before the first key packet
+        return;
+    }
+
+    // Copy the payload rather than referencing it: the queued packet stays
+    // the only owner of its buffer, and can still be converted in place.
+    AVPacket *copy = av_packet_alloc();
+    if (!copy) {
+        return;
+    }
+    copy->buf = packet_pool_get(mPacketPool, pkt->size);
+    if (!copy->buf || av_packet_copy_props(copy, pkt) < 0) {
+        av_packet_free(&copy);
+        return;
+    }
+    memcpy(copy->buf->data, pkt->data, pkt->size);
+    copy->data = copy->buf->data;
+    copy->size = pkt->size;
+    mGopRecording->mPackets.push_back(copy);
+    mGopRecording->mBytes += pkt->size + sizeof(AVPacket);
+    mGopCacheBytes += pkt->size + sizeof(AVPacket);
+    if (pkt->stream_index == mVideoStreamIdx && ts != AV_NOPTS_VALUE
+            && ts > mGopRecording->mLastTs) {
+        mGopRecording->mLastTs = ts;
+    }
+
+    while (mGopCacheBytes > (size_t)mGopCacheLimit && !mGopCache.isEmpty()) {
+        if (mGopCache.itemAt(0) == mGopRecording) {
+            ALOGV("(gop cache) GOP @ %" PRId64 " larger than the cache, dropping it",
+                  mGopRecording->mKeyTs);
+        }
+        removeGopSegment(0);
+    }
+}
+
+// Called with mDemuxLock held.
+void FFmpegExtractor::removeGopSegment(size_t index)
+{
+    GopSegment *seg = mGopCache.itemAt(index);
+    uint32_t run = mGopNextRun++;
+
+    // the segments following it are no longer contiguous with the ones before
+    for (size_t i = 0; i < mGopCache.size(); ++i) {
+        GopSegment *other = mGopCache.itemAt(i);
+        if (other->mRun == seg->mRun && other->mSeq > seg->mSeq) {
+            other->mRun = run;
+        }
+    }
+    if (mGopRecording == seg) {
+        mGopRecording = NULL;
+    }
+    if (mGopRecording) {
+        // keep recording in the run it may have moved to
+        mGopRun = mGopRecording->mRun;
+    }
+
+    for (size_t i = 0; i < seg->mPackets.size(); ++i) {
+        AVPacket *pkt = seg->mPackets.itemAt(i);
+        av_packet_free(&pkt);
+    }
+    mGopCacheBytes -= seg->mBytes;
+    mGopCache.removeAt(index);
+    delete seg;
+}
+
+FFmpegExtractor::GopSegment *FFmpegExtractor::findGopSegment(uint32_t run, uint32_t seq)
+{
+    for (size_t i = 0; i < mGopCache.size(); ++i) {
+        GopSegment *seg = mGopCache.itemAt(i);
+        if (seg->mRun == run && seg->mSeq == seq) {
+            return seg;
+        }
+    }
+    return NULL;
+}
+
+// Called with mDemuxLock held, when seeking: the demuxer position no longer
+// follows what was recorded.
+void FFmpegExtractor::stopGopCache()
+{
+    mGopRecording = NULL;
+    mGopReplay = NULL;
+    mGopRun = mGopNextRun++;
+    mGopSeq = 0;
+    for (size_t i = 0; i < mTracks.size(); ++i) {
+        mTracks.editItemAt(i).mReplayTs = AV_NOPTS_VALUE;
+    }
+}
+
+// Called with mDemuxLock held.
+bool FFmpegExtractor::startGopReplay(int64_t pos,
+        MediaTrackHelper::ReadOptions::SeekMode mode)
+{
+    GopSegment *best = NULL;
+    bool next = mode == MediaTrackHelper::ReadOptions::SEEK_NEXT_SYNC;
+
+    for (size_t i = 0; i < mGopCache.size(); ++i) {
+        GopSegment *seg = mGopCache.itemAt(i);
+        if (next) {
+            if (seg->mKeyTs >= pos && (!best || seg->mKeyTs < best->mKeyTs)) {
+                best = seg;
+            }
+        } else if (seg->mKeyTs <= pos && (!best || seg->mKeyTs > best->mKeyTs)) {
+            best = seg;
+        }
+    }
+    if (!best) {
+        return false;
+    }
+
+    // Make sure no uncached key frame is closer to the position.
+    if (next) {
+        GopSegment *prev = best->mSeq > 0 ? findGopSegment(best->mRun, best->mSeq - 1) : NULL;
+        if (!prev || prev->mKeyTs > pos) {
+            return false;
+        }
+    } else if (best->mLastTs < pos && !findGopSegment(best->mRun, best->mSeq + 1)) {
+        return false;
+    }
+
+    ALOGV("(gop cache) seek to %" PRId64 " served from the GOP @ %" PRId64, pos, best->mKeyTs);
+    mGopReplay = best;
+    mGopReplayPos = 0;
+    return true;
+}
+
+// Called with mDemuxLock held. Returns false, and resumes demuxing, once the
+// run is over.
+bool FFmpegExtractor::replayGopPacket(AVPacket *pkt)
+{
+    while (mGopReplayPos >= mGopReplay->mPackets.size()) {
+        GopSegment *seg = findGopSegment(mGopReplay->mRun, mGopReplay->mSeq + 1);
+        if (!seg) {
+            resumeAfterGopReplay();
+            return false;
+        }
+        mGopReplay = seg;
+        mGopReplayPos = 0;
+    }
+
+    av_packet_ref(pkt, mGopReplay->mPackets.itemAt(mGopReplayPos++));
+
+    TrackInfo *track = findTrack(pkt->stream_index);
+    int64_t ts = packetTimeUs(pkt, mFormatCtx->streams[pkt->stream_index]);
+    if (track && ts != AV_NOPTS_VALUE) {
+        track->mReplayTs = ts;
+    }
+    return true;
+}
+
+// Called with mDemuxLock held.
+void FFmpegExtractor::resumeAfterGopReplay()
+{
+    GopSegment *last = mGopReplay;
+    int err;
+
+    mGopReplay = NULL;
+
+    // Demux the last segment again, skipping what was replayed, and keep
+    // recording it: this extends the run.
+    ALOGV("(gop cache) end of cached GOPs, resuming @ %" PRId64, last->mKeyTs);
+    err = avformat_seek_file(mFormatCtx, -1, INT64_MIN, last->mKeyTs, last->mKeyTs, 0);
+    if (err < 0) {
+        ALOGE("(gop cache) resume failed(%s (%08x)), seeking again", av_err2str(err), err);
+        resumeWithSeek(last->mKeyTs);
+        return;
+    }
+
+    mGopRecording = last;
+    mGopRun = last->mRun;
+    mGopSeq = last->mSeq + 1;
+}
+
+// Called with mDemuxLock held, when the demuxer cannot get back to the end
+// of a replayed run: seek the usual way, without the cache, and still drop
+// what was replayed.
+void FFmpegExtractor::resumeWithSeek(int64_t keyTs)
+{
+    Vector<int64_t> replayTs;
+    int trackIndex = 0;
+
+    for (size_t i = 0; i < mTracks.size(); ++i) {
+        const TrackInfo& ti = mTracks.itemAt(i);
+        replayTs.push_back(ti.mReplayTs);
+        if (ti.mStream->index == mVideoStreamIdx) {
+            trackIndex = i;
+        }
+    }
+
+    clearGopCache();
+    {
+        TrackInfo& track = mTracks.editItemAt(trackIndex);
+        Mutex::Autolock _t(*track.mLock);
+        track.mSeekCovered = false;
+    }
+    if (doStreamSeek(trackIndex, keyTs, MediaTrackHelper::ReadOptions::SEEK_PREVIOUS_SYNC,
+            mSeekRequests) != SEEK) {
+        mEOF = true;
+        return;
+    }
+
+    for (size_t i = 0; i < mTracks.size(); ++i) {
+        TrackInfo& ti = mTracks.editItemAt(i);
+        if (replayTs[i] == AV_NOPTS_VALUE) {
+            continue;
+        }
+        Mutex::Autolock _t(*ti.mLock);
+        // what follows the replayed packets is not a new start
+        ti.mReplayTs = replayTs[i];
+        ti.mSeek = false;
+        ti.mSeekCovered = false;
+        if (!ti.mDiscarded) {
+            ti.mStream->discard = ti.mKeyOnly ? AVDISCARD_NONKEY : AVDISCARD_DEFAULT;
+        }
+    }
+}
+
+// Called with mDemuxLock held. Drops the packets demuxed again after a
+// replay, up to the last replayed one of each track.
+bool FFmpegExtractor::skipReplayedPacket(AVPacket *pkt)
+{
+    TrackInfo *track = findTrack(pkt->stream_index);
+
+    if (!track || track->mReplayTs == AV_NOPTS_VALUE) {
+        return false;
+    }
+
+    int64_t ts = packetTimeUs(pkt, track->mStream);
+    if (ts != AV_NOPTS_VALUE && ts <= track->mReplayTs) {
+        return true;
+    }
+    track->mReplayTs = AV_NOPTS_VALUE;
+    return false;
+}
+
+void FFmpegExtractor::clearGopCache()
+{
+    while (!mGopCache.isEmpty()) {
+        removeGopSegment(mGopCache.size() - 1);
+    }
+    mGopRecording = NULL;
+    mGopReplay = NULL;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+
+void FFmpegExtractor::setTrackKeyOnly(size_t trackIndex, bool keyOnly)
+{
+    Mutex::Autolock _l(mDemuxLock);
+    TrackInfo& track = mTracks.editItemAt(trackIndex);
+    Mutex::Autolock _t(*track.mLock);
+
+    track.mKeyOnly = keyOnly;
+    if (!track.mDiscarded) {
+        track.mStream->discard = keyOnly ? AVDISCARD_NONKEY : AVDISCARD_DEFAULT;
+    }
+}
+
+void FFmpegExtractor::startReaderThread() {
+    Mutex::Autolock _l(mDemuxLock);
+
+    if (!mReaderThreadEnabled || mReaderThreadStarted || mAbortRequest) {
+        return;
+    }
+
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_JOINABLE);
+    if (pthread_create(&mReaderThread, &attr, ReaderWrapper, this) == 0) {
+        mReaderThreadStarted = true;
+    } else {
+        ALOGE("failed to start reader thread, demuxing on the caller thread");
+    }
+    pthread_attr_destroy(&attr);
+}
+
+void FFmpegExtractor::stopReaderThread() {
+    {
+        Mutex::Autolock _l(mDemuxLock);
+
+        if (!mReaderThreadStarted) {
+            return;
+        }
+        mAbortRequest = 1;
+        mReaderCondition.signal();
+        mDataCondition.broadcast();
+    }
+
+    pthread_join(mReaderThread, NULL);
+    mReaderThreadStarted = false;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+#define ZIGZAG(v) (((uint64_t)(v) << 1) ^ (uint64_t)((v) >> 63))
+#define UNZIGZAG(v) ((int64_t)((v) >> 1) ^ -(int64_t)((v) & 1))
+
+static void putVarint(AVIOContext *pb, uint64_t v)
+{
+    while (v >= 0x80) {
+        avio_w8(pb, (v & 0x7f) | 0x80);
+        v >>= 7;
+    }
+    avio_w8(pb, v);
+}
+
+static bool getVarint(const uint8_t **p, const uint8_t *end, uint64_t *v)
+{
+    *v = 0;
+    for (int shift = 0; shift < 64 && *p < end; shift += 7) {
+        uint8_t b = *(*p)++;
+        *v |= (uint64_t)(b & 0x7f) << shift;
+        if (!(b & 0x80))
+            return true;
+    }
+    return false;
+}
+
+/* Identifies the file by its size, head and tail, and its path and
+ * modification time when it is a local file. Returns 0 on failure. */
+static uint64_t computeCacheKey(CDataSource *source)
+{
+    char uri[PATH_MAX];
+    struct stat st;
+    off64_t size = -1;
+    ssize_t n;
+    uint64_t key = 0;
+
+    if (source->getSize(source->handle, &size) != OK || size <= 0)
+        return 0;
+    key = ffmpeg_cache_hash(key, &size, sizeof(size));
+
+    if (source->getUri(source->handle, uri, sizeof(uri)) && uri[0] == '/' && !stat(uri, &st)) {
+        int64_t mtime = st.st_mtime;
+        key = ffmpeg_cache_hash(key, uri, strlen(uri));
+        key = ffmpeg_cache_hash(key, &mtime, sizeof(mtime));
+    }
+
+    uint8_t *buf = (uint8_t *)av_malloc(CACHE_FINGERPRINT_SIZE);
+    if (!buf)
+        return 0;
+
+    n = source->readAt(source->handle, 0, buf, CACHE_FINGERPRINT_SIZE);
+    if (n > 0) {
+        key = ffmpeg_cache_hash(key, buf, n);
+        if (size > CACHE_FINGERPRINT_SIZE) {
+            n = source->readAt(source->handle, size - CACHE_FINGERPRINT_SIZE,
+                    buf, CACHE_FINGERPRINT_SIZE);
+            if (n > 0)
+                key = ffmpeg_cache_hash(key, buf, n);
+        }
+    }
+    av_free(buf);
+
+    if (n <= 0)
+        return 0;
+    return key ? key : 1;
+}
+
+/* Demuxers without a seek index fall back to linear scanning or bitrate
+ * guesses. Record the keyframes of the default stream (the one used by
+ * avformat_seek_file) as they are demuxed, so that the generic and binary
+ * search seek code finds them, and keep them in the sidecar cache. */
+void FFmpegExtractor::initKeyframeIndex()
+{
+    AVStream *stream;
+    int idx;
+
+    if (!mFormatCtx->pb || !(mFormatCtx->pb->seekable & AVIO_SEEKABLE_NORMAL)
+            || (mFormatCtx->iformat->flags & AVFMT_NO_BYTE_SEEK)) {
+        return;
+    }
+
+    idx = av_find_default_stream_index(mFormatCtx);
+    if (idx < 0 || !findTrack(idx)) {
+        return;
+    }
+
+    stream = mFormatCtx->streams[idx];
+    if (hasUsableIndex(stream)) {
+        return;
+    }
+
+    ALOGV("[%s] no usable seek index, indexing keyframes",
+          av_get_media_type_string(stream->codecpar->codec_type));
+    mIndexStreamIdx = idx;
+
+    if (mCacheKey && loadKeyframeIndex() && mIndexComplete) {
+        return;
+    }
+
+    if (property_get_bool("debug.ffmpeg.extractor.background-index", 0)) {
+        pthread_attr_t attr;
+        pthread_attr_init(&attr);
+        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_JOINABLE);
+        if (pthread_create(&mIndexerThread, &attr, IndexerWrapper, this) == 0) {
+            mIndexerStarted = true;
+        } else {
+            ALOGE("failed to start indexer thread");
+        }
+        pthread_attr_destroy(&attr);
+    }
+}
+
+/* An index is usable when it reaches (almost) the end of the stream */
+bool FFmpegExtractor::hasUsableIndex(const AVStream *stream)
+{
+    int count = avformat_index_get_entries_count(stream);
+    int64_t startTime = stream->start_time != AV_NOPTS_VALUE ? stream->start_time : 0;
+
+    if (count < 2) {
+        return false;
+    }
+    if (mDuration == AV_NOPTS_VALUE || mDuration <= 0) {
+        return true;
+    }
+
+    const AVIndexEntry *last = avformat_index_get_entry(stream, count - 1);
+    return av_rescale_q(last->timestamp - startTime, stream->time_base, AV_TIME_BASE_Q)
+            >= mDuration * 9 / 10;
+}
+
+// Called with mDemuxLock held.
+bool FFmpegExtractor::addIndexEntry(int64_t pos, int64_t ts, int64_t *lastTs)
+{
+    AVStream *stream = mFormatCtx->streams[mIndexStreamIdx];
+
+    if (pos < 0 || ts == AV_NOPTS_VALUE) {
+        return false;
+    }
+
+    // audio packets are all key frames, do not index every one of them
+    if (stream->codecpar->codec_type != AVMEDIA_TYPE_VIDEO
+            && *lastTs != AV_NOPTS_VALUE && ts >= *lastTs
+            && av_rescale_q(ts - *lastTs, stream->time_base, AV_TIME_BASE_Q)
+                    < INDEX_MIN_INTERVAL_US) {
+        return false;
+    }
+
+    if (av_add_index_entry(stream, pos, ts, 0, 0, AVINDEX_KEYFRAME) < 0) {
+        return false;
+    }
+
+    *lastTs = ts;
+    mIndexDirty = true;
+    return true;
+}
+
+/* Sidecar layout, all varints: stream index, codec id, time base,
+ * complete flag, entry count, then zigzag coded deltas of each entry
+ * timestamp and position. */
+bool FFmpegExtractor::loadKeyframeIndex()
+{
+    AVStream *stream = mFormatCtx->streams[mIndexStreamIdx];
+    uint8_t *data;
+    int size;
+    const uint8_t *p, *end;
+    uint64_t idx, codecId, num, den, complete, count, v;
+    int64_t ts = 0, pos = 0;
+
+    if (ffmpeg_cache_load("index", mCacheKey, &data, &size) < 0) {
+        return false;
+    }
+
+    p = data;
+    end = data + size;
+    if (!getVarint(&p, end, &idx) || !getVarint(&p, end, &codecId)
+            || !getVarint(&p, end, &num) || !getVarint(&p, end, &den)
+            || !getVarint(&p, end, &complete) || !getVarint(&p, end, &count)
+            || idx != (uint64_t)mIndexStreamIdx
+            || codecId != (uint64_t)stream->codecpar->codec_id
+            || num != (uint64_t)stream->time_base.num
+            || den != (uint64_t)stream->time_base.den) {
+        ALOGW("keyframe index does not match the stream, ignoring it");
+        av_free(data);
+        return false;
+    }
+
+    for (uint64_t i = 0; i < count; i++) {
+        if (!getVarint(&p, end, &v))
+            break;
+        ts += UNZIGZAG(v);
+        if (!getVarint(&p, end, &v))
+            break;
+        pos += UNZIGZAG(v);
+        av_add_index_entry(stream, pos, ts, 0, 0, AVINDEX_KEYFRAME);
+    }
+    av_free(data);
+
+    mIndexComplete = complete && p == end;
+
+    ALOGI("loaded keyframe index: %d entries%s",
+          avformat_index_get_entries_count(stream), mIndexComplete ? " (complete)" : "");
+
+    return true;
+}
+
+/* The entries are serialized under mDemuxLock, the demuxer and the indexer
+ * add to them; the sidecar is written without holding it. */
+void FFmpegExtractor::storeKeyframeIndex()
+{
+    AVIOContext *pb;
+    uint8_t *data;
+    int64_t ts = 0, pos = 0;
+    int count, size;
+
+    {
+        Mutex::Autolock _l(mDemuxLock);
+
+        if (!mCacheKey || !mIndexDirty || mIndexStreamIdx < 0) {
+            return;
+        }
+
+        AVStream *stream = mFormatCtx->streams[mIndexStreamIdx];
+        count = avformat_index_get_entries_count(stream);
+
+        if (count <= 0 || avio_open_dyn_buf(&pb) < 0) {
+            return;
+        }
+
+        putVarint(pb, mIndexStreamIdx);
+        putVarint(pb, stream->codecpar->codec_id);
+        putVarint(pb, stream->time_base.num);
+        putVarint(pb, stream->time_base.den);
+        putVarint(pb, mIndexComplete);
+        putVarint(pb, count);
+        for (int i = 0; i < count; i++) {
+            const AVIndexEntry *e = avformat_index_get_entry(stream, i);
+            putVarint(pb, ZIGZAG(e->timestamp - ts));
+            putVarint(pb, ZIGZAG(e->pos - pos));
+            ts = e->timestamp;
+            pos = e->pos;
+        }
+        mIndexDirty = false;
+    }
+
+    size = avio_close_dyn_buf(pb, &data);
+    if (ffmpeg_cache_store("index", mCacheKey, data, size) == 0) {
+        ALOGV("stored keyframe index: %d entries, %d bytes", count, size);
+    } else {
+        Mutex::Autolock _l(mDemuxLock);
+        mIndexDirty = true;
+    }
+    av_free(data);
+}
+
+void *FFmpegExtractor::IndexerWrapper(void *me) {
+    ((FFmpegExtractor *)me)->indexerEntry();
+    return NULL;
+}
+
+/* Scan the whole file with a second demuxer and merge its keyframes into
+ * the index, without holding the demuxer of the tracks for long. */
+void FFmpegExtractor::indexerEntry() {
+    AVFormatContext *ic = NULL;
+    AVPacket *pkt = NULL;
+    int64_t entries[INDEX_MERGE_ENTRIES][2];
+    int64_t lastTs = AV_NOPTS_VALUE;
+    int nb_entries = 0, nb_indexed = 0;
+    int64_t startUs = get_timestamp();
+    int err;
+    bool eof = false, complete = false;
+
+    prctl(PR_SET_NAME, (unsigned long)"FFmpegIndexer", 0, 0, 0);
+
+    ic = avformat_alloc_context();
+    pkt = av_packet_alloc();
+    if (!ic || !pkt) {
+        goto done;
+    }
+    ic->interrupt_callback.callback = decodeInterruptCb;
+    ic->interrupt_callback.opaque = this;
+
+    err = ffmpeg_source_open_input(&ic, mFilename, NULL, NULL);
+    if (err < 0) {
+        ALOGE("indexer: avformat_open_input failed: %s (%08x)", av_err2str(err), err);
+        goto done;
+    }
+    if ((int)ic->nb_streams <= mIndexStreamIdx) {
+        avformat_find_stream_info(ic, NULL);
+    }
+    if ((int)ic->nb_streams <= mIndexStreamIdx
+            || ic->streams[mIndexStreamIdx]->codecpar->codec_id
+                    != mFormatCtx->streams[mIndexStreamIdx]->codecpar->codec_id) {
+        ALOGW("indexer: streams do not match, giving up");
+        goto done;
+    }
+    for (int i = 0; i < (int)ic->nb_streams; i++) {
+        if (i != mIndexStreamIdx)
+            ic->streams[i]->discard = AVDISCARD_ALL;
+    }
 
-            streamComponentOpen(mVideoStreamIdx);
-            if (!mDefersToCreateVideoTrack) {
-                ALOGI("[video] probe packet counter: %zu when track created", mPktCounter);
+    while (!mAbortRequest) {
+        err = av_read_frame(ic, pkt);
+        if (err == AVERROR(EAGAIN)) {
+            continue;
+        }
+        eof = err < 0;
+        if (!eof) {
+            if (pkt->stream_index == mIndexStreamIdx && (pkt->flags & AV_PKT_FLAG_KEY)) {
+                entries[nb_entries][0] = pkt->pos;
+                entries[nb_entries][1] = pkt->dts != AV_NOPTS_VALUE ? pkt->dts : pkt->pts;
+                nb_entries++;
             }
+            av_packet_unref(pkt);
         }
-    } else if (pkt->stream_index == mAudioStreamIdx) {
-        AVCodecParameters *avpar = mFormatCtx->streams[mAudioStreamIdx]->codecpar;
 
-        if (mAudioBsfc && pkt->data) {
-            ret = av_bsf_send_packet(mAudioBsfc, pkt);
-            if (ret < 0) {
-                ALOGE("[audio::%s] failed to send packet to filter, err = %d", mAudioBsfc->filter->name, ret);
-                av_packet_unref(pkt);
-                return ret;
-            }
-            ret = av_bsf_receive_packet(mAudioBsfc, pkt);
-            if (ret < 0) {
-                ALOGE_IF(ret != AVERROR(EAGAIN), "[audio::%s] failed to received packet from filter, err=%d",
-                         mAudioBsfc->filter->name, ret);
-                av_packet_unref(pkt);
-                return ret;
+        if (nb_entries == INDEX_MERGE_ENTRIES || (eof && !mAbortRequest)) {
+            Mutex::Autolock _l(mDemuxLock);
+            for (int i = 0; i < nb_entries; i++) {
+                addIndexEntry(entries[i][0], entries[i][1], &lastTs);
             }
-            if (mDefersToCreateAudioTrack && avpar->extradata_size <= 0) {
-                size_t new_extradata_size = 0;
-                uint8_t* new_extradata = av_packet_get_side_data(pkt, AV_PKT_DATA_NEW_EXTRADATA, &new_extradata_size);
-
-                if (new_extradata_size > 0) {
-                    ALOGV("[audio::%s] extradata found, len=%zd", mAudioBsfc->filter->name, new_extradata_size);
-                    avpar->extradata = (uint8_t*)av_mallocz(new_extradata_size + AV_INPUT_BUFFER_PADDING_SIZE);
-                    if (avpar->extradata) {
-                        memcpy(avpar->extradata, new_extradata, new_extradata_size);
-                        avpar->extradata_size = new_extradata_size;
-                    } else {
-                        ALOGE("[audio::%s] failed to allocate new extradata", mAudioBsfc->filter->name);
-                        return AVERROR(ENOMEM);
-                    }
-                }
+            nb_entries = 0;
+            if (eof) {
+                mIndexComplete = err == AVERROR_EOF;
             }
+            complete = mIndexComplete;
+            nb_indexed = avformat_index_get_entries_count(mFormatCtx->streams[mIndexStreamIdx]);
         }
+        if (eof) {
+            break;
+        }
+    }
 
-        if (mDefersToCreateAudioTrack) {
-            if (avpar->extradata_size <= 0) {
-                av_packet_unref(pkt);
-                return AVERROR(EAGAIN);
-            }
-            streamComponentOpen(mAudioStreamIdx);
-            if (!mDefersToCreateAudioTrack) {
-                ALOGI("[audio] probe packet counter: %zu when track created", mPktCounter);
-            }
+    ALOGI("indexer %s in %" PRId64 " ms: %d entries", complete ? "done" : "stopped",
+          (get_timestamp() - startUs) / 1000, nb_indexed);
+
+    if (complete) {
+        storeKeyframeIndex();
+    }
+
+done:
+    av_packet_free(&pkt);
+    ffmpeg_source_close_input(&ic);
+}
+
+void FFmpegExtractor::stopIndexer() {
+    if (!mIndexerStarted) {
+        return;
+    }
+
+    // mAbortRequest interrupts the indexer demuxer
+    mAbortRequest = 1;
+    pthread_join(mIndexerThread, NULL);
+    mIndexerStarted = false;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+/* Stream info cache layout, little endian: version, sniffed mime,
+ * confidence and url kind, demuxer name, duration, start time, bit rate,
+ * then the codec parameters and timing of every stream. */
+struct CacheReader {
+    CacheReader(const uint8_t *data, int size)
+        : mPtr(data), mEnd(data + size), mError(false) {}
+
+    uint32_t rl32() {
+        const uint8_t *p = bytes(4);
+        return p ? AV_RL32(p) : 0;
+    }
+
+    uint64_t rl64() {
+        const uint8_t *p = bytes(8);
+        return p ? AV_RL64(p) : 0;
+    }
+
+    AVRational rational() {
+        AVRational q;
+        q.num = rl32();
+        q.den = rl32();
+        return q;
+    }
+
+    AString string() {
+        uint32_t len = rl32();
+        const uint8_t *p = bytes(len);
+        return p ? AString((const char *)p, len) : AString();
+    }
+
+    const uint8_t *bytes(uint32_t size) {
+        if (mError || (uint32_t)(mEnd - mPtr) < size) {
+            mError = true;
+            return NULL;
         }
+        const uint8_t *p = mPtr;
+        mPtr += size;
+        return p;
     }
 
-    // Queue frame
+    bool error() const { return mError; }
 
-    if (pkt->stream_index == mVideoStreamIdx) {
-        packet_queue_put(mVideoQ, pkt);
-        return mVideoStreamIdx;
-    } else if (pkt->stream_index == mAudioStreamIdx) {
-        packet_queue_put(mAudioQ, pkt);
-        return mAudioStreamIdx;
+private:
+    const uint8_t *mPtr;
+    const uint8_t *mEnd;
+    bool mError;
+};
+
+static void writeString(AVIOContext *pb, const char *s)
+{
+    avio_wl32(pb, strlen(s));
+    avio_write(pb, (const unsigned char *)s, strlen(s));
+}
+
+static void writeRational(AVIOContext *pb, AVRational q)
+{
+    avio_wl32(pb, q.num);
+    avio_wl32(pb, q.den);
+}
+
+/* The sniffing result, without opening the source */
+static bool loadSniffInfo(uint64_t key, AString *mime, float *confidence,
+        bool *legacyUrl, AString *format)
+{
+    uint8_t *data;
+    int size;
+
+    if (ffmpeg_cache_load("streams", key, &data, &size) < 0) {
+        return false;
+    }
+
+    CacheReader r(data, size);
+    uint32_t version = r.rl32();
+    AString cachedMime = r.string();
+    float cachedConfidence = av_int2float(r.rl32());
+    bool cachedLegacyUrl = r.rl32();
+    AString cachedFormat = r.string();
+    av_free(data);
+
+    if (r.error() || version != STREAM_INFO_VERSION
+            || cachedMime.empty() || cachedConfidence <= 0) {
+        return false;
+    }
+
+    *mime = cachedMime;
+    *confidence = cachedConfidence;
+    *legacyUrl = cachedLegacyUrl;
+    *format = cachedFormat;
+    return true;
+}
+
+struct CachedStream {
+    AVCodecParameters *mPar;
+    AVRational mTimeBase;
+    AVRational mAvgFrameRate;
+    AVRational mRFrameRate;
+    int64_t mStartTime;
+    int64_t mDuration;
+    int64_t mNbFrames;
+    int mDisposition;
+};
+
+static bool readCachedStream(CacheReader& r, CachedStream *cs)
+{
+    AVCodecParameters *par = cs->mPar;
+    int order, nb_channels, extradata_size;
+    uint64_t mask;
+    const uint8_t *extradata;
+
+    par->codec_type            = (enum AVMediaType)r.rl32();
+    par->codec_id              = (enum AVCodecID)r.rl32();
+    par->codec_tag             = r.rl32();
+    par->format                = r.rl32();
+    par->bit_rate              = r.rl64();
+    par->bits_per_coded_sample = r.rl32();
+    par->bits_per_raw_sample   = r.rl32();
+    par->profile               = r.rl32();
+    par->level                 = r.rl32();
+    par->width                 = r.rl32();
+    par->height                = r.rl32();
+    par->sample_aspect_ratio   = r.rational();
+    par->field_order           = (enum AVFieldOrder)r.rl32();
+    par->color_range           = (enum AVColorRange)r.rl32();
+    par->color_primaries       = (enum AVColorPrimaries)r.rl32();
+    par->color_trc             = (enum AVColorTransferCharacteristic)r.rl32();
+    par->color_space           = (enum AVColorSpace)r.rl32();
+    par->chroma_location       = (enum AVChromaLocation)r.rl32();
+    par->video_delay           = r.rl32();
+    order                      = r.rl32();
+    nb_channels                = r.rl32();
+    mask                       = r.rl64();
+    par->sample_rate           = r.rl32();
+    par->block_align           = r.rl32();
+    par->frame_size            = r.rl32();
+    par->initial_padding       = r.rl32();
+    par->trailing_padding      = r.rl32();
+    par->seek_preroll          = r.rl32();
+    cs->mTimeBase              = r.rational();
+    cs->mAvgFrameRate          = r.rational();
+    cs->mRFrameRate            = r.rational();
+    cs->mStartTime             = r.rl64();
+    cs->mDuration              = r.rl64();
+    cs->mNbFrames              = r.rl64();
+    cs->mDisposition           = r.rl32();
+    extradata_size             = r.rl32();
+    extradata                  = r.bytes(extradata_size);
+
+    if (r.error() || nb_channels < 0 || extradata_size < 0) {
+        return false;
+    }
+
+    if (order == AV_CHANNEL_ORDER_NATIVE) {
+        av_channel_layout_from_mask(&par->ch_layout, mask);
     } else {
-        av_packet_unref(pkt);
-        return AVERROR(EAGAIN);
+        par->ch_layout.order = AV_CHANNEL_ORDER_UNSPEC;
+        par->ch_layout.nb_channels = nb_channels;
+    }
+
+    if (extradata_size > 0) {
+        par->extradata = (uint8_t *)av_mallocz(extradata_size + AV_INPUT_BUFFER_PADDING_SIZE);
+        if (!par->extradata) {
+            return false;
+        }
+        memcpy(par->extradata, extradata, extradata_size);
+        par->extradata_size = extradata_size;
     }
+
+    return true;
 }
 
-int FFmpegExtractor::getPacket(int trackIndex, AVPacket *pkt) {
-    TrackInfo& track = mTracks.editItemAt(trackIndex);
-    const char* type = av_get_media_type_string(track.mStream->codecpar->codec_type);
-    int err;
+static void writeCachedStream(AVIOContext *pb, const AVStream *st)
+{
+    const AVCodecParameters *par = st->codecpar;
+
+    avio_wl32(pb, par->codec_type);
+    avio_wl32(pb, par->codec_id);
+    avio_wl32(pb, par->codec_tag);
+    avio_wl32(pb, par->format);
+    avio_wl64(pb, par->bit_rate);
+    avio_wl32(pb, par->bits_per_coded_sample);
+    avio_wl32(pb, par->bits_per_raw_sample);
+    avio_wl32(pb, par->profile);
+    avio_wl32(pb, par->level);
+    avio_wl32(pb, par->width);
+    avio_wl32(pb, par->height);
+    writeRational(pb, par->sample_aspect_ratio);
+    avio_wl32(pb, par->field_order);
+    avio_wl32(pb, par->color_range);
+    avio_wl32(pb, par->color_primaries);
+    avio_wl32(pb, par->color_trc);
+    avio_wl32(pb, par->color_space);
+    avio_wl32(pb, par->chroma_location);
+    avio_wl32(pb, par->video_delay);
+    avio_wl32(pb, par->ch_layout.order);
+    avio_wl32(pb, par->ch_layout.nb_channels);
+    avio_wl64(pb, par->ch_layout.order == AV_CHANNEL_ORDER_NATIVE ? par->ch_layout.u.mask : 0);
+    avio_wl32(pb, par->sample_rate);
+    avio_wl32(pb, par->block_align);
+    avio_wl32(pb, par->frame_size);
+    avio_wl32(pb, par->initial_padding);
+    avio_wl32(pb, par->trailing_padding);
+    avio_wl32(pb, par->seek_preroll);
+    writeRational(pb, st->time_base);
+    writeRational(pb, st->avg_frame_rate);
+    writeRational(pb, st->r_frame_rate);
+    avio_wl64(pb, st->start_time);
+    avio_wl64(pb, st->duration);
+    avio_wl64(pb, st->nb_frames);
+    avio_wl32(pb, st->disposition);
+    avio_wl32(pb, par->extradata_size);
+    avio_write(pb, par->extradata, par->extradata_size);
+}
 
-    while (true) {
-        Mutex::Autolock _l(mLock);
-
-        err = packet_queue_get(track.mQueue, pkt, 0);
-        if (err > 0) {
-            if (track.mSeek && (pkt->flags & AV_PKT_FLAG_KEY) != 0) {
-                ALOGV("[%s] (seek) key frame found @ ts=%" PRId64,
-                      type, pkt->pts != AV_NOPTS_VALUE ? av_rescale_q(pkt->pts, track.mStream->time_base, AV_TIME_BASE_Q) : -1);
-                track.mSeek = false;
-            }
-            if (! track.mSeek) {
-                return 0;
-            } else {
-                ALOGV("[%s] (seek) drop non key frame", type);
-            }
-        } else if (err < 0) {
-            return AVERROR_UNKNOWN;
-        } else if (err == 0) {
-            err = feedNextPacket();
-            if (err < 0 && err != AVERROR(EAGAIN)) {
-                return err;
-            }
+/* Restore the stream info found by a previous open of the same file,
+ * instead of probing it again with avformat_find_stream_info(). */
+bool FFmpegExtractor::loadStreamInfo()
+{
+    CachedStream *streams = NULL;
+    uint8_t *data;
+    int size;
+    uint32_t nb_streams = 0, i;
+    int64_t duration, startTime, bitRate;
+    bool ok = false;
+
+    if (!mCacheKey || ffmpeg_cache_load("streams", mCacheKey, &data, &size) < 0) {
+        return false;
+    }
+
+    CacheReader r(data, size);
+    if (r.rl32() != STREAM_INFO_VERSION) {
+        goto done;
+    }
+    r.string();
+    r.rl32();
+    r.rl32();
+    if (strcmp(r.string().c_str(), mFormatCtx->iformat->name)) {
+        goto done;
+    }
+    duration   = r.rl64();
+    startTime  = r.rl64();
+    bitRate    = r.rl64();
+    nb_streams = r.rl32();
+    if (r.error() || nb_streams != mFormatCtx->nb_streams) {
+        ALOGV("cached stream info does not match the demuxer");
+        goto done;
+    }
+
+    streams = (CachedStream *)av_calloc(nb_streams, sizeof(*streams));
+    if (!streams) {
+        goto done;
+    }
+    for (i = 0; i < nb_streams; i++) {
+        const AVStream *st = mFormatCtx->streams[i];
+        streams[i].mPar = avcodec_parameters_alloc();
+        if (!streams[i].mPar || !readCachedStream(r, &streams[i])
+                || av_cmp_q(streams[i].mTimeBase, st->time_base)
+                || (st->codecpar->codec_type != AVMEDIA_TYPE_UNKNOWN
+                    && st->codecpar->codec_type != streams[i].mPar->codec_type)) {
+            ALOGV("cached stream info of stream %u does not match", i);
+            nb_streams = i + 1;
+            goto done;
+        }
+    }
+
+    for (i = 0; i < nb_streams; i++) {
+        AVStream *st = mFormatCtx->streams[i];
+        if (avcodec_parameters_copy(st->codecpar, streams[i].mPar) < 0) {
+            goto done;
+        }
+        st->avg_frame_rate = streams[i].mAvgFrameRate;
+        st->r_frame_rate   = streams[i].mRFrameRate;
+        st->start_time     = streams[i].mStartTime;
+        st->duration       = streams[i].mDuration;
+        st->nb_frames      = streams[i].mNbFrames;
+        st->disposition    = streams[i].mDisposition;
+    }
+    mFormatCtx->duration   = duration;
+    mFormatCtx->start_time = startTime;
+    mFormatCtx->bit_rate   = bitRate;
+    ok = true;
+
+    ALOGI("restored cached stream info, %u streams", nb_streams);
+
+done:
+    if (streams) {
+        for (i = 0; i < nb_streams; i++) {
+            avcodec_parameters_free(&streams[i].mPar);
         }
+        av_free(streams);
+    }
+    av_free(data);
+    return ok;
+}
+
+void FFmpegExtractor::storeStreamInfo()
+{
+    AVIOContext *pb;
+    uint8_t *data;
+    const char *mime = NULL;
+    int size;
+
+    if (!mCacheKey || mStreamInfoCached || mStreamInfoFromHeader
+            || mSniffConfidence <= 0 || (mTracks.isEmpty() && mHeaderFormats.isEmpty())
+            || !AMediaFormat_getString(mMeta, AMEDIAFORMAT_KEY_MIME, &mime)
+            || avio_open_dyn_buf(&pb) < 0) {
+        return;
+    }
+
+    avio_wl32(pb, STREAM_INFO_VERSION);
+    writeString(pb, mime);
+    avio_wl32(pb, av_float2int(mSniffConfidence));
+    avio_wl32(pb, strstr(mFilename, "|file:") != NULL);
+    writeString(pb, mFormatCtx->iformat->name);
+    avio_wl64(pb, mFormatCtx->duration);
+    avio_wl64(pb, mFormatCtx->start_time);
+    avio_wl64(pb, mFormatCtx->bit_rate);
+    avio_wl32(pb, mFormatCtx->nb_streams);
+    for (unsigned i = 0; i < mFormatCtx->nb_streams; i++) {
+        writeCachedStream(pb, mFormatCtx->streams[i]);
     }
+
+    size = avio_close_dyn_buf(pb, &data);
+    ffmpeg_cache_store("streams", mCacheKey, data, size);
+    av_free(data);
 }
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -1230,9 +3499,14 @@ FFmpegSource::FFmpegSource(
       mIsAVC(false),
       mIsHEVC(false),
       mNal2AnnexB(false),
+      mZeroCopy(property_get_bool("debug.ffmpeg.extractor.zero-copy", 1)),
       mStream(mExtractor->mTracks.itemAt(index).mStream),
-      mLastPTS(AV_NOPTS_VALUE),
-      mTargetTime(AV_NOPTS_VALUE) {
+      mTargetTime(AV_NOPTS_VALUE),
+      mTrickPlayUs(0),
+      mTrickTargetUs(AV_NOPTS_VALUE),
+      mLastKeyTimeUs(AV_NOPTS_VALUE),
+      mLastSyncSeekUs(AV_NOPTS_VALUE),
+      mReadsSinceSeek(0) {
     AMediaFormat *meta = mExtractor->mTracks.itemAt(index).mMeta;
     AVCodecParameters *avpar = mStream->codecpar;
 
@@ -1299,16 +3573,48 @@ FFmpegSource::~FFmpegSource() {
 media_status_t FFmpegSource::start() {
     ALOGV("[%s] FFmpegSource::start",
           av_get_media_type_string(mMediaType));
-    mBufferGroup->init(1, 1024, 64);
+    size_t buffers, bufferSize, growthLimit;
+    mExtractor->getBufferGroupSize(mTrackIndex, mZeroCopy, &buffers, &bufferSize, &growthLimit);
+    mBufferGroup->init(buffers, bufferSize, growthLimit);
+    mExtractor->setTrackStarted(mTrackIndex, true);
+
+    mTrickPlayUs = 0;
+    mTrickTargetUs = AV_NOPTS_VALUE;
+    mLastKeyTimeUs = AV_NOPTS_VALUE;
+    mLastSyncSeekUs = AV_NOPTS_VALUE;
+    mReadsSinceSeek = 0;
+
+    mExtractor->startReaderThread();
     return AMEDIA_OK;
 }
 
 media_status_t FFmpegSource::stop() {
     ALOGV("[%s] FFmpegSource::stop",
           av_get_media_type_string(mMediaType));
+    if (mTrickPlayUs) {
+        mExtractor->setTrackKeyOnly(mTrackIndex, false);
+    }
+    mExtractor->setTrackStarted(mTrackIndex, false);
     return AMEDIA_OK;
 }
 
+/* Trick play is entered when the client steps from key frame to key frame
+ * with sync seeks, and left on any other seek. 0 leaves it. */
+void FFmpegSource::setTrickPlay(int64_t strideUs)
+{
+    if (!mTrickPlayUs == !strideUs) {
+        mTrickPlayUs = strideUs;
+        return;
+    }
+    if (strideUs) {
+        ALOGI("[video] trick play, one key frame every %" PRId64 " us", strideUs);
+    } else {
+        ALOGI("[video] trick play over");
+    }
+    mTrickPlayUs = strideUs;
+    mExtractor->setTrackKeyOnly(mTrackIndex, strideUs != 0);
+}
+
 media_status_t FFmpegSource::getFormat(AMediaFormat *meta) {
     AMediaFormat_copy(meta, mExtractor->mTracks.itemAt(mTrackIndex).mMeta);
     return AMEDIA_OK;
@@ -1343,9 +3649,53 @@ media_status_t FFmpegSource::read(
         }
         ALOGV("[%s] (seek) seekTimeUs[+startTime]: %" PRId64 ", mode: %d start_time=%" PRId64,
               av_get_media_type_string(mMediaType), seekPTS, mode, startTimeUs);
-        mExtractor->streamSeek(mTrackIndex, seekPTS, mode);
+
+        // A sync seek right after the previous one, in the same direction,
+        // is a step of a fast forward/rewind: the distance is the stride.
+        bool sync = mode == ReadOptions::SEEK_PREVIOUS_SYNC
+                || mode == ReadOptions::SEEK_NEXT_SYNC;
+        int64_t stride = seekTimeUs - mLastSyncSeekUs;
+        if (mMediaType == AVMEDIA_TYPE_VIDEO && sync && mLastSyncSeekUs != AV_NOPTS_VALUE
+                && mReadsSinceSeek <= 1 && stride
+                && (!mTrickPlayUs || (stride > 0) == (mTrickPlayUs > 0))) {
+            setTrickPlay(stride);
+        } else if (mTrickPlayUs) {
+            setTrickPlay(0);
+        }
+        mLastSyncSeekUs = sync ? seekTimeUs : AV_NOPTS_VALUE;
+        mReadsSinceSeek = 0;
+
+        if (mTrickPlayUs) {
+            // the other tracks are not played meanwhile
+            mExtractor->trackSeek(mTrackIndex, seekPTS, mode);
+        } else {
+            mExtractor->streamSeek(mTrackIndex, seekPTS, mode);
+        }
+
+        // the decoder drops the frames before the target
+        mTargetTime = mode == ReadOptions::SEEK_CLOSEST ? seekTimeUs : AV_NOPTS_VALUE;
+        if (mTrickPlayUs) {
+            // keep mLastKeyTimeUs, so that a step never shows the same key frame twice
+            mTrickTargetUs = seekTimeUs;
+        } else {
+            mTrickTargetUs = AV_NOPTS_VALUE;
+            mLastKeyTimeUs = AV_NOPTS_VALUE;
+        }
+    } else if (mTrickPlayUs && mReadsSinceSeek > 0) {
+        // The client reads on without stepping: back to normal playback,
+        // from the key frame shown last, with the other tracks.
+        setTrickPlay(0);
+        mLastSyncSeekUs = AV_NOPTS_VALUE;
+        if (mLastKeyTimeUs != AV_NOPTS_VALUE) {
+            mExtractor->streamSeek(mTrackIndex, mLastKeyTimeUs + startTimeUs,
+                                   ReadOptions::SEEK_PREVIOUS_SYNC);
+        }
+        mTrickTargetUs = AV_NOPTS_VALUE;
+        mLastKeyTimeUs = AV_NOPTS_VALUE;
     }
 
+    mReadsSinceSeek++;
+
 retry:
     err = mExtractor->getPacket(mTrackIndex, &pkt);
     if (err < 0) {
@@ -1365,38 +3715,6 @@ retry:
         mFirstKeyPktTimestamp = pktTS;
     }
 
-    MediaBufferHelper *mediaBuffer;
-    mBufferGroup->acquire_buffer(&mediaBuffer, false, pkt.size + AV_INPUT_BUFFER_PADDING_SIZE);
-    AMediaFormat_clear(mediaBuffer->meta_data());
-    mediaBuffer->set_range(0, pkt.size);
-
-    //copy data
-    if ((mIsAVC || mIsHEVC) && mNal2AnnexB) {
-        /* This only works for NAL sizes 3-4 */
-        if ((mNALLengthSize != 3) && (mNALLengthSize != 4)) {
-            ALOGE("[%s] cannot use convertNal2AnnexB, nal size: %zu",
-                  av_get_media_type_string(mMediaType), mNALLengthSize);
-            mediaBuffer->release();
-            mediaBuffer = NULL;
-            av_packet_unref(&pkt);
-            return AMEDIA_ERROR_MALFORMED;
-        }
-
-        uint8_t *dst = (uint8_t *)mediaBuffer->data();
-        /* Convert H.264 NAL format to annex b */
-        status = convertNal2AnnexB(dst, pkt.size, pkt.data, pkt.size, mNALLengthSize);
-        if (status != AMEDIA_OK) {
-            ALOGE("[%s] convertNal2AnnexB failed",
-                  av_get_media_type_string(mMediaType));
-            mediaBuffer->release();
-            mediaBuffer = NULL;
-            av_packet_unref(&pkt);
-            return AMEDIA_ERROR_MALFORMED;
-        }
-    } else {
-        memcpy(mediaBuffer->data(), pkt.data, pkt.size);
-    }
-
     if (pktTS != AV_NOPTS_VALUE)
         timeUs = av_rescale_q(pktTS, mStream->time_base, AV_TIME_BASE_Q) - startTimeUs;
     else
@@ -1411,8 +3729,6 @@ retry:
                " packet dts: %" PRId64
                " packet pts: %" PRId64
                , av_get_media_type_string(mMediaType), timeUs, startTimeUs, pkt.dts, pkt.pts);
-        mediaBuffer->release();
-        mediaBuffer = NULL;
         av_packet_unref(&pkt);
         if (max_negative_time_frame-- > 0) {
             goto retry;
@@ -1423,15 +3739,27 @@ retry:
         }
     }
 
-    // FIXME: figure out what this is supposed to do...
-    // // predict the next PTS to use for exact-frame seek below
-    // int64_t nextPTS = AV_NOPTS_VALUE;
-    // if (mLastPTS != AV_NOPTS_VALUE && timeUs > mLastPTS) {
-    //     nextPTS = timeUs + (timeUs - mLastPTS);
-    //     mLastPTS = timeUs;
-    // } else if (mLastPTS == AV_NOPTS_VALUE) {
-    //     mLastPTS = timeUs;
-    // }
+    if (mTrickPlayUs && timeUs != SF_NOPTS_VALUE) {
+        if (mTrickTargetUs != AV_NOPTS_VALUE) {
+            if (mTrickPlayUs > 0 && timeUs < mTrickTargetUs) {
+                av_packet_unref(&pkt);
+                goto retry;
+            }
+            if (mTrickPlayUs < 0 && mLastKeyTimeUs != AV_NOPTS_VALUE
+                    && timeUs >= mLastKeyTimeUs) {
+                // landed on the same key frame again, go further back
+                av_packet_unref(&pkt);
+                mTrickTargetUs += mTrickPlayUs;
+                if (mTrickTargetUs < 0) {
+                    return AMEDIA_ERROR_END_OF_STREAM;
+                }
+                mExtractor->trackSeek(mTrackIndex, mTrickTargetUs + startTimeUs,
+                                      ReadOptions::SEEK_PREVIOUS_SYNC);
+                goto retry;
+            }
+        }
+        mLastKeyTimeUs = timeUs;
+    }
 
 #if DEBUG_PKT
     if (pktTS != AV_NOPTS_VALUE)
@@ -1442,27 +3770,72 @@ retry:
             av_get_media_type_string(mMediaType), pkt.size, key);
 #endif
 
+    bool nal2AnnexB = (mIsAVC || mIsHEVC) && mNal2AnnexB;
+
+    /* This only works for NAL sizes 3-4 */
+    if (nal2AnnexB && (mNALLengthSize != 3) && (mNALLengthSize != 4)) {
+        ALOGE("[%s] cannot use convertNal2AnnexB, nal size: %zu",
+              av_get_media_type_string(mMediaType), mNALLengthSize);
+        av_packet_unref(&pkt);
+        return AMEDIA_ERROR_MALFORMED;
+    }
+
+    MediaBufferHelper *mediaBuffer = NULL;
+
+    // Hand the packet payload over without copying it. Start codes and NAL
+    // lengths have the same size, so the conversion can be done in place,
+    // as long as nobody else references the payload.
+    if (mZeroCopy && pkt.buf != NULL
+            && (!nal2AnnexB || packet_pool_make_writable(mExtractor->mPacketPool, &pkt) >= 0)) {
+        if (nal2AnnexB) {
+            status = convertNal2AnnexB(pkt.data, pkt.size, pkt.data, pkt.size, mNALLengthSize);
+            if (status != AMEDIA_OK) {
+                ALOGE("[%s] convertNal2AnnexB failed",
+                      av_get_media_type_string(mMediaType));
+                av_packet_unref(&pkt);
+                return AMEDIA_ERROR_MALFORMED;
+            }
+        }
+        mediaBuffer = FFmpegPacketBuffer::wrap(&pkt);
+    }
+
+    if (mediaBuffer == NULL) {
+        mBufferGroup->acquire_buffer(&mediaBuffer, false, pkt.size + AV_INPUT_BUFFER_PADDING_SIZE);
+        AMediaFormat_clear(mediaBuffer->meta_data());
+        mediaBuffer->set_range(0, pkt.size);
+
+        //copy data
+        if (nal2AnnexB) {
+            uint8_t *dst = (uint8_t *)mediaBuffer->data();
+            /* Convert H.264 NAL format to annex b */
+            status = convertNal2AnnexB(dst, pkt.size, pkt.data, pkt.size, mNALLengthSize);
+            if (status != AMEDIA_OK) {
+                ALOGE("[%s] convertNal2AnnexB failed",
+                      av_get_media_type_string(mMediaType));
+                mediaBuffer->release();
+                mediaBuffer = NULL;
+                av_packet_unref(&pkt);
+                return AMEDIA_ERROR_MALFORMED;
+            }
+        } else {
+            memcpy(mediaBuffer->data(), pkt.data, pkt.size);
+        }
+    }
+
     AMediaFormat_setInt64(mediaBuffer->meta_data(), AMEDIAFORMAT_KEY_TIME_US, timeUs);
     AMediaFormat_setInt32(mediaBuffer->meta_data(), AMEDIAFORMAT_KEY_IS_SYNC_FRAME, key);
 
-    // FIXME: also figure out what this is supposed to do...
-    // // deal with seek-to-exact-frame, we might be off a bit and Stagefright will assert on us
-    // if (seekTimeUs != AV_NOPTS_VALUE && timeUs < seekTimeUs &&
-    //         mode == MediaSource::ReadOptions::SEEK_CLOSEST) {
-    //     mTargetTime = seekTimeUs;
-    //     AMediaFormat_setInt64(mediaBuffer->meta_data(), AMEDIAFORMAT_KEY_TARGET_TIME, seekTimeUs);
-    // }
-
-    // if (mTargetTime != AV_NOPTS_VALUE) {
-    //     if (timeUs == mTargetTime) {
-    //         mTargetTime = AV_NOPTS_VALUE;
-    //     } else if (nextPTS != AV_NOPTS_VALUE && nextPTS > mTargetTime) {
-    //         ALOGV("[%s] adjust target frame time to %" PRId64,
-    //               av_get_media_type_string(mMediaType), timeUs);
-    //         AMediaFormat_setInt64(mediaBuffer->meta_data(), AMEDIAFORMAT_KEY_TIME_US, mTargetTime);
-    //         mTargetTime = AV_NOPTS_VALUE;
-    //     }
-    // }
+    // Only the first buffer after the seek carries the target time, like
+    // the stock extractors do; it is the sync frame the decoding restarts at.
+    if (mTargetTime != AV_NOPTS_VALUE) {
+        if (timeUs != SF_NOPTS_VALUE && timeUs < mTargetTime) {
+            ALOGV("[%s] (seek) target time: %" PRId64 ", first frame: %" PRId64,
+                  av_get_media_type_string(mMediaType), mTargetTime, timeUs);
+            AMediaFormat_setInt64(mediaBuffer->meta_data(), AMEDIAFORMAT_KEY_TARGET_TIME,
+                                  mTargetTime);
+        }
+        mTargetTime = AV_NOPTS_VALUE;
+    }
 
     *buffer = mediaBuffer;
 
@@ -1473,6 +3846,41 @@ retry:
 
 ////////////////////////////////////////////////////////////////////////////////
 
+/* Takes over the reference of pkt, returns NULL if pkt is left untouched */
+MediaBufferHelper *FFmpegPacketBuffer::wrap(AVPacket *pkt) {
+    FFmpegPacketBuffer *self = new FFmpegPacketBuffer;
+
+    self->mPacket = av_packet_alloc();
+    if (!self->mPacket) {
+        delete self;
+        return NULL;
+    }
+    av_packet_move_ref(self->mPacket, pkt);
+
+    self->mBuffer = new MediaBuffer(self->mPacket->data, self->mPacket->size);
+    self->mBuffer->setObserver(self);
+    self->mBuffer->add_ref();
+    self->mHelper = new MediaBufferHelper(self->mBuffer->wrap());
+
+    return self->mHelper;
+}
+
+void FFmpegPacketBuffer::signalBufferReturned(MediaBufferBase *buffer) {
+    CHECK(buffer == mBuffer);
+    delete this;
+}
+
+FFmpegPacketBuffer::~FFmpegPacketBuffer() {
+    if (mBuffer) {
+        mBuffer->setObserver(NULL);
+        mBuffer->release();
+    }
+    delete mHelper;
+    av_packet_free(&mPacket);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
 typedef struct {
     const char *format;
     const char *container;
@@ -1500,6 +3908,100 @@ static formatmap FILE_FORMATS[] = {
         {"divx",                    MEDIA_MIMETYPE_CONTAINER_DIVX     },
 };
 
+#define PREFILTER_SIZE 4096
+#define SNIFF_PROBE_SIZE (1024 * 1024)
+
+typedef struct {
+    int offset;
+    int size;
+    const char *magic;
+    const char *format; // demuxer to open the source with, NULL to reject it
+} signature;
+
+/* Looked up in order, before invoking libavformat */
+static const signature SIGNATURES[] = {
+        // not media, or left to the stock extractors/decoders
+        {0, 3,  "\xff\xd8\xff",                     NULL       }, // jpeg
+        {0, 8,  "\x89PNG\r\n\x1a\n",                 NULL       },
+        {0, 4,  "GIF8",                             NULL       },
+        {0, 4,  "%PDF",                             NULL       },
+        {0, 4,  "PK\x03\x04",                       NULL       }, // zip, apk, ...
+        {0, 4,  "\x7f""ELF",                         NULL       },
+        {0, 4,  "Rar!",                             NULL       },
+        {0, 6,  "7z\xbc\xaf\x27\x1c",                 NULL       },
+        {0, 2,  "\x1f\x8b",                          NULL       }, // gzip
+        {0, 4,  "II*\x00",                          NULL       }, // tiff
+        {0, 4,  "MM\x00*",                          NULL       },
+        {8, 4,  "WEBP",                             NULL       },
+        {8, 4,  "heic",                             NULL       },
+        {8, 4,  "heix",                             NULL       },
+        {8, 4,  "mif1",                             NULL       },
+        {8, 4,  "msf1",                             NULL       },
+        {8, 4,  "avif",                             NULL       },
+        // containers of FILE_FORMATS
+        {4, 4,  "ftyp",                             "mov"      },
+        {4, 4,  "moov",                             "mov"      },
+        {4, 4,  "mdat",                             "mov"      },
+        {0, 4,  "\x1a\x45\xdf\xa3",                   "matroska" },
+        {8, 4,  "AVI ",                             "avi"      },
+        {8, 4,  "WAVE",                             "wav"      },
+        {0, 8,  "\x30\x26\xb2\x75\x8e\x66\xcf\x11",   "asf"      },
+        {0, 3,  "FLV",                              "flv"      },
+        {0, 4,  ".RMF",                             "rm"       },
+        {0, 4,  "OggS",                             "ogg"      },
+        {0, 4,  "fLaC",                             "flac"     },
+        {0, 4,  "MAC ",                             "ape"      },
+        {0, 4,  "\x00\x00\x01\xba",                   "mpeg"     },
+};
+
+static bool isTransportStream(const uint8_t *buf, int size, int packetSize, int offset)
+{
+    int count = 0;
+
+    for (int i = offset; i < size; i += packetSize, count++) {
+        if (buf[i] != 0x47)
+            return false;
+    }
+    return count >= 3;
+}
+
+/* Cheap check of the first bytes of the source: returns false if it is
+ * not worth probing, otherwise sets fmt to the demuxer to use, if known */
+static bool prefilterSource(CDataSource *source, const AVInputFormat **fmt)
+{
+    uint8_t buf[PREFILTER_SIZE];
+    ssize_t n;
+
+    *fmt = NULL;
+
+    n = source->readAt(source->handle, 0, buf, sizeof(buf));
+    if (n <= 0) {
+        // let libavformat report the error
+        return true;
+    }
+
+    for (size_t i = 0; i < NELEM(SIGNATURES); ++i) {
+        const signature *sig = &SIGNATURES[i];
+        if (sig->offset + sig->size <= n
+                && !memcmp(buf + sig->offset, sig->magic, sig->size)) {
+            if (!sig->format) {
+                ALOGV("prefilter: rejecting source, signature %zu", i);
+                return false;
+            }
+            *fmt = av_find_input_format(sig->format);
+            ALOGV("prefilter: format %s", sig->format);
+            return true;
+        }
+    }
+
+    if (isTransportStream(buf, n, 188, 0) || isTransportStream(buf, n, 192, 4)) {
+        *fmt = av_find_input_format("mpegts");
+        ALOGV("prefilter: format mpegts");
+    }
+
+    return true;
+}
+
 static AVCodecParameters* getCodecParameters(AVFormatContext *ic, AVMediaType codec_type)
 {
     unsigned int idx = 0;
@@ -1873,7 +4375,8 @@ static const char *findMatchingContainer(const char *name)
     return container;
 }
 
-static const char *SniffFFMPEGCommon(const char *url, float *confidence, bool isStreaming)
+static const char *SniffFFMPEGCommon(const char *url, float *confidence, bool isStreaming,
+        AMessage *meta, const AVInputFormat *fmt)
 {
     int err = 0;
     size_t i = 0;
@@ -1884,6 +4387,7 @@ static const char *SniffFFMPEGCommon(const char *url, float *confidence, bool is
     AVDictionary *codec_opts = NULL;
     AVDictionary **opts = NULL;
     bool needProbe = false;
+    bool probed = false;
 
     static status_t status = initFFmpeg();
     if (status != OK) {
@@ -1899,11 +4403,21 @@ static const char *SniffFFMPEGCommon(const char *url, float *confidence, bool is
     }
 
     // Don't download more than a meg
-    ic->probesize = 1024 * 1024;
+    ic->probesize = SNIFF_PROBE_SIZE;
 
     timeNow = ALooper::GetNowUs();
 
-    err = avformat_open_input(&ic, url, NULL, NULL);
+    err = ffmpeg_source_open_input(&ic, url, fmt, NULL);
+    if (err < 0 && fmt) {
+        ALOGW("avformat_open_input(%s) as %s failed, probing", url, fmt->name);
+        ic = avformat_alloc_context();
+        if (!ic) {
+            ALOGE("oom for alloc avformat context");
+            goto fail;
+        }
+        ic->probesize = SNIFF_PROBE_SIZE;
+        err = ffmpeg_source_open_input(&ic, url, NULL, NULL);
+    }
 
     if (err < 0) {
         ALOGE("avformat_open_input(%s) failed: %s (%08x)", url, av_err2str(err), err);
@@ -1948,6 +4462,7 @@ static const char *SniffFFMPEGCommon(const char *url, float *confidence, bool is
         av_freep(&opts);
 
         av_dump_format(ic, 0, url, 0);
+        probed = true;
     }
 
     ALOGV("sniff(%s): format_name: %s, format_long_name: %s",
@@ -1961,16 +4476,23 @@ static const char *SniffFFMPEGCommon(const char *url, float *confidence, bool is
             container = NULL;
     }
 
+    if (container) {
+        // hand the opened context over to the extractor, see FreeMeta()
+        meta->setPointer("extended-extractor-context", ic);
+        meta->setInt32("extended-extractor-probed", probed);
+        ic = NULL;
+    }
+
 fail:
     if (ic) {
-        avformat_close_input(&ic);
+        ffmpeg_source_close_input(&ic);
     }
 
     return container;
 }
 
 static const char *BetterSniffFFMPEG(CDataSource *source,
-        float *confidence, AMessage *meta)
+        float *confidence, AMessage *meta, const AVInputFormat *fmt)
 {
     const char *ret = NULL;
     char url[PATH_MAX] = {0};
@@ -1981,7 +4503,7 @@ static const char *BetterSniffFFMPEG(CDataSource *source,
     snprintf(url, sizeof(url), "android-source:%p", source);
 
     ret = SniffFFMPEGCommon(url, confidence,
-            (source->flags(source->handle) & DataSourceBase::kIsCachingDataSource));
+            (source->flags(source->handle) & DataSourceBase::kIsCachingDataSource), meta, fmt);
     if (ret) {
         meta->setString("extended-extractor-url", url);
     }
@@ -1990,7 +4512,7 @@ static const char *BetterSniffFFMPEG(CDataSource *source,
 }
 
 static const char *LegacySniffFFMPEG(CDataSource *source,
-         float *confidence, AMessage *meta)
+         float *confidence, AMessage *meta, const AVInputFormat *fmt)
 {
     const char *ret = NULL;
     char uri[PATH_MAX] = {0};
@@ -2008,7 +4530,7 @@ static const char *LegacySniffFFMPEG(CDataSource *source,
     // pass the addr of smart pointer("source") + file name
     snprintf(url, sizeof(url), "android-source:%p|file:%s", source, uri);
 
-    ret = SniffFFMPEGCommon(url, confidence, false);
+    ret = SniffFFMPEGCommon(url, confidence, false, meta, fmt);
     if (ret) {
         meta->setString("extended-extractor-url", url);
     }
@@ -2018,7 +4540,16 @@ static const char *LegacySniffFFMPEG(CDataSource *source,
 
 static void FreeMeta(void *meta) {
     if (meta != nullptr) {
-        static_cast<AMessage *>(meta)->decStrong(nullptr);
+        AMessage *msg = static_cast<AMessage *>(meta);
+        void *ic = NULL;
+
+        // the sniffed context was not taken by an extractor
+        if (msg->findPointer("extended-extractor-context", &ic) && ic) {
+            AVFormatContext *ctx = static_cast<AVFormatContext *>(ic);
+            ffmpeg_source_close_input(&ctx);
+            msg->setPointer("extended-extractor-context", NULL);
+        }
+        msg->decStrong(nullptr);
     }
 }
 
@@ -2028,6 +4559,11 @@ SniffFFMPEG(
         FreeMetaFunc *freeMeta) {
 
     float newConfidence = 0.08f;
+    const AVInputFormat *fmt = NULL;
+    uint64_t cacheKey = 0;
+    AString cachedMime, cachedFormat;
+    bool legacyUrl = false;
+    const char *container = NULL;
 
     ALOGV("SniffFFMPEG (initial confidence: %f)", *confidence);
 
@@ -2039,21 +4575,49 @@ SniffFFMPEG(
         }
     }
 
+    if (!prefilterSource(source, &fmt)) {
+        return NULL;
+    }
+
     AMessage *msg = new AMessage;
 
     *meta = msg;
     *freeMeta = FreeMeta;
     msg->incStrong(nullptr);
 
-    const char *container = BetterSniffFFMPEG(source, &newConfidence, msg);
+    if (ffmpeg_cache_enabled()) {
+        cacheKey = computeCacheKey(source);
+    }
+
+    if (cacheKey && loadSniffInfo(cacheKey, &cachedMime, &newConfidence,
+                                  &legacyUrl, &cachedFormat)) {
+        char uri[PATH_MAX] = {0};
+        char url[PATH_MAX] = {0};
+
+        if (!legacyUrl) {
+            snprintf(url, sizeof(url), "android-source:%p", source);
+        } else if (source->getUri(source->handle, uri, sizeof(uri))) {
+            snprintf(url, sizeof(url), "android-source:%p|file:%s", source, uri);
+        }
+        if (url[0]) {
+            ALOGV("sniff through the cache: %s (%s)", cachedMime.c_str(), cachedFormat.c_str());
+            msg->setString("extended-extractor-url", url);
+            msg->setString("extended-extractor-format", cachedFormat.c_str());
+            container = cachedMime.c_str();
+        }
+    }
+
     if (!container) {
-        ALOGW("sniff through BetterSniffFFMPEG failed, try LegacySniffFFMPEG");
-        container = LegacySniffFFMPEG(source, &newConfidence, msg);
-        if (container) {
-            ALOGV("sniff through LegacySniffFFMPEG success");
+        container = BetterSniffFFMPEG(source, &newConfidence, msg, fmt);
+        if (!container) {
+            ALOGW("sniff through BetterSniffFFMPEG failed, try LegacySniffFFMPEG");
+            container = LegacySniffFFMPEG(source, &newConfidence, msg, fmt);
+            if (container) {
+                ALOGV("sniff through LegacySniffFFMPEG success");
+            }
+        } else {
+            ALOGV("sniff through BetterSniffFFMPEG success");
         }
-    } else {
-        ALOGV("sniff through BetterSniffFFMPEG success");
     }
 
     if (container == NULL) {
@@ -2070,6 +4634,10 @@ SniffFFMPEG(
     msg->setString("extended-extractor", "extended-extractor");
     msg->setString("extended-extractor-subtype", "ffmpegextractor");
     msg->setString("extended-extractor-mime", container);
+    msg->setFloat("extended-extractor-confidence", newConfidence);
+    if (cacheKey) {
+        msg->setInt64("extended-extractor-cache-key", cacheKey);
+    }
 
     //debug only
     char value[PROPERTY_VALUE_MAX];
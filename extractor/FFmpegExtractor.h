@@ -25,6 +25,8 @@
 #include <utils/threads.h>
 #include <utils/KeyedVector.h>
 
+#include <atomic>
+
 #include "ffmpeg_utils.h"
 
 namespace android {
@@ -57,12 +59,25 @@ private:
         AMediaFormat *mMeta;
         AVStream *mStream;
         PacketQueue *mQueue;
+        Mutex *mLock; // protects mSeek and pops from mQueue
         bool mSeek;
+        bool mSeekCovered;     // repositioned by the seek of another track
+        bool mKeyOnly;         // trick play, only key packets are wanted
+        int64_t mReplayTs;     // last packet replayed from the GOP cache
+        bool mStarted;
+        bool mDiscarded;       // AVDISCARD_ALL until the track is started
+        int64_t mResumeTs;     // first dropped packet, to re-seek at
+        int64_t mSkipUntilTs;  // drop packets before this time after resuming
+        int64_t mLastTs;       // last packet returned to the source
+        int64_t mLastQueuedTs; // last packet queued since the last flush
+        int64_t mDropUntilTs;  // drop demuxed packets up to this time after a resume
+        int mMaxPacketSize;    // largest packet queued so far
     };
 
     Vector<TrackInfo> mTracks;
 
-    mutable Mutex mLock;
+    // protects mFormatCtx and the demuxer state, held while demuxing
+    mutable Mutex mDemuxLock;
 
     DataSourceHelper *mDataSource;
     AMediaFormat *mMeta;
@@ -73,6 +88,19 @@ private:
     int mAudioDisable;
     int mShowStatus;
     int mSeekByBytes;
+    bool mSeekSkipNonKey;      // discard non key packets until the sync sample
+
+    // seek coalescing, the latest seek wins
+    std::atomic<uint32_t> mSeekRequests;
+    std::atomic<int64_t> mRequestedSeekPos; // position of the newest request
+    std::atomic<int> mPendingSeeks;    // seeks waiting for the demuxer
+    Condition mSeekCondition;
+    uint32_t mSeekServing;             // generation of the seek in progress
+    bool mSeeking;                     // in avformat_seek_file()
+    int64_t mLastSeekPos;
+    MediaTrackHelper::ReadOptions::SeekMode mLastSeekMode;
+    int64_t mLastSeekTimeUs;
+    int64_t mSeekCoalesceUs;           // how long a completed seek covers the other tracks
     int64_t mDuration;
     bool mEOF;
     size_t mPktCounter;
@@ -80,8 +108,15 @@ private:
 
     PacketQueue *mAudioQ;
     PacketQueue *mVideoQ;
+    PacketPool *mPacketPool;   // payloads of the GOP cache and the queued packets
+    int mPoolCopyMax;          // larger demuxed payloads are queued as they are
 
     AVFormatContext *mFormatCtx;
+    bool mSniffedProbed;       // stream info was already found by the sniffer
+    bool mStreamInfoCached;    // stream info was restored from the cache
+    bool mStreamInfoFromHeader; // the container header was enough, nothing probed
+    const AVInputFormat *mInputFormat;
+    float mSniffConfidence;
     int mVideoStreamIdx;
     int mAudioStreamIdx;
     AVStream *mVideoStream;
@@ -91,14 +126,110 @@ private:
     AVBSFContext *mVideoBsfc;
     AVBSFContext *mAudioBsfc;
     bool mParsedMetadata;
+    bool mProbePending;        // deferred tracks not created yet
+    bool mTracksOpened;        // set up for reading packets
+    int mSelectedAudioIdx;
+    int mSelectedVideoIdx;
+    Vector<AMediaFormat *> mHeaderFormats; // track formats before the tracks are opened
+    Vector<int> mHeaderStreams;
+    bool mVideoConfigOptional; // the decoder finds the config in band
+
+    // background demuxing
+    bool mReaderThreadEnabled;
+    bool mReaderThreadStarted;
+    pthread_t mReaderThread;
+    Condition mReaderCondition;
+    Condition mDataCondition;
+    int mWaitingForData;
+    bool mReadAhead;
+
+    // frame retrieval: only the video track is read, up to one key frame
+    bool mThumbnailModeEnabled;
+    bool mThumbnailMode;
+
+    // queue memory budget
+    int mBudgetPolicy;
+    int mMaxQueueBytes;
+    int mMaxQueuePackets;
+
+    // keyframe index, for containers without a usable one
+    int mIndexStreamIdx;       // stream indexed while demuxing, -1 if none
+    int64_t mLastIndexedTs;
+    bool mIndexDirty;          // entries were added since the index was loaded
+    bool mIndexComplete;       // the whole file has been indexed
+    uint64_t mCacheKey;        // file identity, 0 if the cache is disabled
+    bool mIndexerStarted;
+    pthread_t mIndexerThread;
+    bool mIndexInitialized;    // set up when the first track starts
+
+    // cache of the GOPs demuxed last
+    struct GopSegment {
+        int64_t mKeyTs;        // time of the video key packet starting it
+        int64_t mLastTs;       // time of its last video packet
+        uint32_t mRun;         // segments of a run were demuxed in sequence
+        uint32_t mSeq;
+        size_t mBytes;
+        Vector<AVPacket *> mPackets;
+    };
+    Vector<GopSegment *> mGopCache; // oldest first
+    int64_t mGopCacheLimit;    // in bytes, 0 if disabled
+    size_t mGopCacheBytes;
+    GopSegment *mGopRecording; // segment packets are added to, if any
+    uint32_t mGopRun;          // run being recorded
+    uint32_t mGopNextRun;
+    uint32_t mGopSeq;
+    GopSegment *mGopReplay;    // segment being replayed, if any
+    size_t mGopReplayPos;
 
     static int decodeInterruptCb(void *ctx);
+    static int demuxInterruptCb(void *ctx);
+    bool waitForPendingSeeks();
+    static void *ReaderWrapper(void *me);
+    void readerEntry();
+    void startReaderThread();
+    void stopReaderThread();
+    bool needsMorePackets();
+    void initQueueBudget();
+    bool isOverBudget(int extraBytes);
+    bool checkQueueBudget(AVPacket *pkt);
+    void resumeDroppedTrack(TrackInfo& track);
+    void setTrackStarted(size_t trackIndex, bool started);
+    void setTrackKeyOnly(size_t trackIndex, bool keyOnly);
+    void recordGopPacket(AVPacket *pkt);
+    void removeGopSegment(size_t index);
+    GopSegment *findGopSegment(uint32_t run, uint32_t seq);
+    void stopGopCache();
+    bool startGopReplay(int64_t pos, MediaTrackHelper::ReadOptions::SeekMode mode);
+    bool replayGopPacket(AVPacket *pkt);
+    void resumeAfterGopReplay();
+    void resumeWithSeek(int64_t keyTs);
+    bool skipReplayedPacket(AVPacket *pkt);
+    void clearGopCache();
+    int64_t enterThumbnailMode(size_t trackIndex, int64_t timeUs);
+    TrackInfo *findTrack(int streamIndex);
+    void initKeyframeIndex();
+    bool hasUsableIndex(const AVStream *stream);
+    bool addIndexEntry(int64_t pos, int64_t ts, int64_t *lastTs);
+    bool loadKeyframeIndex();
+    void storeKeyframeIndex();
+    static void *IndexerWrapper(void *me);
+    void indexerEntry();
+    void stopIndexer();
+    bool loadStreamInfo();
+    void storeStreamInfo();
+    void getBufferGroupSize(size_t trackIndex, bool zeroCopy, size_t *buffers,
+            size_t *bufferSize, size_t *growthLimit);
 
     int initStreams();
+    void buildHeaderFormats();
+    void clearHeaderFormats();
+    void openTracks();
+    void probeDeferredTracks();
     void deInitStreams();
     void fetchStuffsFromSniffedMeta(const sp<AMessage> &meta);
     void setFFmpegDefaultOpts();
     int feedNextPacket();
+    int queuePacket(AVPacket *pkt);
     int getPacket(int trackIndex, AVPacket *pkt);
     bool isCodecSupported(enum AVCodecID codec_id);
     media_status_t setVideoFormat(AVStream *stream, AMediaFormat *meta);
@@ -108,7 +239,14 @@ private:
     void streamComponentClose(int streamIndex);
     int streamSeek(int trackIndex, int64_t pos,
                     MediaTrackHelper::ReadOptions::SeekMode mode);
+    int doStreamSeek(int trackIndex, int64_t pos,
+                    MediaTrackHelper::ReadOptions::SeekMode mode, uint32_t generation);
+    bool sameSeekTarget(int64_t a, int64_t b, MediaTrackHelper::ReadOptions::SeekMode mode);
+    void abandonSeek(TrackInfo& track);
+    int trackSeek(int trackIndex, int64_t pos,
+                    MediaTrackHelper::ReadOptions::SeekMode mode);
     int checkExtradata(AVCodecParameters *avpar);
+    int extractVideoExtradata(AVCodecParameters *avpar, const AVPacket *pkt);
 
     DISALLOW_EVIL_CONSTRUCTORS(FFmpegExtractor);
 };
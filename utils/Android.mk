@@ -4,6 +4,7 @@ include $(SF_COMMON_MK)
 
 LOCAL_SRC_FILES := \
 	ffmpeg_source.cpp \
+	ffmpeg_startcode.cpp \
 	ffmpeg_utils.cpp \
 	ffmpeg_cmdutils.c \
 	ffmpeg_hwaccel.c \
@@ -43,3 +44,31 @@ LOCAL_EXPORT_HEADER_LIBRARY_HEADERS += libaudio_system_headers media_ndk_headers
 LOCAL_CLANG_CFLAGS += -DAVUTIL_ARM_INTREADWRITE_H
 
 include $(BUILD_SHARED_LIBRARY)
+
+# ffmpeg_find_startcode() against a byte by byte scan, and its throughput.
+# The scalar variants build the same code without SSE2/NEON.
+STARTCODE_TEST_SRC_FILES := \
+	ffmpeg_startcode.cpp \
+	tests/ffmpeg_startcode_test.cpp
+
+include $(CLEAR_VARS)
+LOCAL_MODULE := ffmpeg_startcode_test
+LOCAL_SRC_FILES := $(STARTCODE_TEST_SRC_FILES)
+include $(BUILD_NATIVE_TEST)
+
+include $(CLEAR_VARS)
+LOCAL_MODULE := ffmpeg_startcode_test
+LOCAL_SRC_FILES := $(STARTCODE_TEST_SRC_FILES)
+include $(BUILD_HOST_NATIVE_TEST)
+
+include $(CLEAR_VARS)
+LOCAL_MODULE := ffmpeg_startcode_scalar_test
+LOCAL_SRC_FILES := $(STARTCODE_TEST_SRC_FILES)
+LOCAL_CFLAGS += -U__SSE2__ -U__ARM_NEON
+include $(BUILD_NATIVE_TEST)
+
+include $(CLEAR_VARS)
+LOCAL_MODULE := ffmpeg_startcode_scalar_test
+LOCAL_SRC_FILES := $(STARTCODE_TEST_SRC_FILES)
+LOCAL_CFLAGS += -U__SSE2__ -U__ARM_NEON
+include $(BUILD_HOST_NATIVE_TEST)
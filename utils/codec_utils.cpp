@@ -486,7 +486,9 @@ media_status_t convertNal2AnnexB(uint8_t *dst, size_t dst_size,
         src += nal_len_size;
         src_size -= nal_len_size;
 
-        memcpy(dst, src, nal_len);
+        if (dst != src) {
+            memcpy(dst, src, nal_len);
+        }
 
         dst += nal_len;
         src += nal_len;
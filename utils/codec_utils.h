@@ -75,7 +75,7 @@ media_status_t setDTSFormat(AVCodecParameters *avpar, AMediaFormat *meta);
 media_status_t setFLACFormat(AVCodecParameters *avpar, AMediaFormat *meta);
 media_status_t setALACFormat(AVCodecParameters *avpar, AMediaFormat *meta);
 
-//Convert H.264 NAL format to annex b
+//Convert H.264 NAL format to annex b, dst may be the same as src
 media_status_t convertNal2AnnexB(uint8_t *dst, size_t dst_size,
         uint8_t *src, size_t src_size, size_t nal_len_size);
 
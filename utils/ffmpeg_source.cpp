@@ -18,10 +18,19 @@
 #define LOG_TAG "FFMPEG"
 #include <utils/Log.h>
 
+#include <fcntl.h>
 #include <inttypes.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/stat.h>
 #include "ffmpeg_source.h"
 
+#include <cutils/properties.h>
+#include <utils/Condition.h>
+#include <utils/Mutex.h>
 #include <media/MediaExtractorPluginApi.h>
 #include <media/stagefright/DataSourceBase.h>
 #include <media/stagefright/MediaErrors.h>
@@ -29,77 +38,522 @@
 extern "C" {
 
 #include "config.h"
-#include "libavformat/url.h"
+#include "libavformat/avformat.h"
 #include "libavutil/error.h"
 
 }
 
+#define DEFAULT_IO_BUFFER_SIZE (256 * 1024)
+#define MIN_IO_BUFFER_SIZE     (4 * 1024)
+#define MAX_IO_BUFFER_SIZE     (4 * 1024 * 1024)
+#define DEFAULT_PREFETCH_SIZE  (4 * 1024 * 1024)
+#define PREFETCH_CHUNK_SIZE    (64 * 1024)
+#define INTERRUPT_POLL_NS      (20 * 1000000LL)
+
 namespace android {
 
+/* Custom AVIOContexts are not polled by ffmpeg */
+static bool io_interrupted(const AVIOInterruptCB *cb)
+{
+    return cb && cb->callback && cb->callback(cb->opaque);
+}
+
+/* Keeps a window of data ahead of the read offset in flight on a worker
+ * thread, for sources whose reads have a high latency. */
+class Prefetcher
+{
+public:
+    Prefetcher(CDataSource *source, size_t size, const AVIOInterruptCB *interrupt);
+    ~Prefetcher();
+
+    bool start();
+    ssize_t read(int64_t offset, unsigned char *buf, size_t size);
+    void seek(int64_t offset);
+    void getStats(FFSourceStats *stats);
+
+private:
+    static void *ThreadWrapper(void *me);
+    void threadEntry();
+    void restartAt(int64_t offset);
+
+    CDataSource *mSource;
+    const AVIOInterruptCB *mInterrupt;
+    Mutex mLock;
+    Condition mCondition;       // signals the worker
+    Condition mDataCondition;   // signals the readers
+    pthread_t mThread;
+    bool mStarted;
+    bool mStop;
+
+    // ring buffer holding [mStart, mStart + mFilled) of the source
+    uint8_t *mBuffer;
+    size_t mSize;
+    size_t mHead;
+    size_t mFilled;
+    int64_t mStart;
+    uint32_t mGeneration;       // bumped when the window is invalidated
+    bool mDone;                 // reached EOS or an error, see mStatus
+    ssize_t mStatus;
+
+    FFSourceStats mStats;
+};
+
+Prefetcher::Prefetcher(CDataSource *source, size_t size, const AVIOInterruptCB *interrupt)
+    : mSource(source),
+      mInterrupt(interrupt),
+      mStarted(false),
+      mStop(false),
+      mBuffer(NULL),
+      mSize(size),
+      mHead(0),
+      mFilled(0),
+      mStart(0),
+      mGeneration(0),
+      mDone(false),
+      mStatus(0) {
+    memset(&mStats, 0, sizeof(mStats));
+}
+
+Prefetcher::~Prefetcher()
+{
+    if (mStarted) {
+        {
+            Mutex::Autolock autoLock(mLock);
+            mStop = true;
+            mCondition.signal();
+            mDataCondition.broadcast();
+        }
+        pthread_join(mThread, NULL);
+    }
+
+    ALOGV("Prefetcher[%p]: hits: %" PRId64 ", misses: %" PRId64 ", prefetched: %" PRId64,
+          mSource, mStats.hits, mStats.misses, mStats.prefetched);
+    av_free(mBuffer);
+}
+
+bool Prefetcher::start()
+{
+    mBuffer = (uint8_t *)av_malloc(mSize);
+    if (!mBuffer) {
+        return false;
+    }
+
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_JOINABLE);
+    mStarted = pthread_create(&mThread, &attr, ThreadWrapper, this) == 0;
+    pthread_attr_destroy(&attr);
+
+    return mStarted;
+}
+
+void *Prefetcher::ThreadWrapper(void *me)
+{
+    ((Prefetcher *)me)->threadEntry();
+    return NULL;
+}
+
+void Prefetcher::threadEntry()
+{
+    uint8_t *chunk = (uint8_t *)av_malloc(PREFETCH_CHUNK_SIZE);
+
+    prctl(PR_SET_NAME, (unsigned long)"FFSourcePrefetch", 0, 0, 0);
+
+    Mutex::Autolock autoLock(mLock);
+
+    while (!mStop) {
+        if (!chunk || mDone || mFilled == mSize) {
+            mCondition.wait(mLock);
+            continue;
+        }
+
+        int64_t pos = mStart + mFilled;
+        uint32_t generation = mGeneration;
+        size_t len = FFMIN(mSize - mFilled, (size_t)PREFETCH_CHUNK_SIZE);
+
+        mLock.unlock();
+        ssize_t n = mSource->readAt(mSource->handle, pos, chunk, len);
+        mLock.lock();
+
+        if (generation != mGeneration) {
+            // invalidated while reading
+            continue;
+        }
+
+        if (n <= 0) {
+            mDone = true;
+            mStatus = n;
+        } else {
+            size_t tail = (mHead + mFilled) % mSize;
+            size_t first = FFMIN((size_t)n, mSize - tail);
+            memcpy(mBuffer + tail, chunk, first);
+            memcpy(mBuffer, chunk + first, n - first);
+            mFilled += n;
+            mStats.prefetched += n;
+        }
+        mDataCondition.broadcast();
+    }
+
+    av_free(chunk);
+}
+
+// Called with mLock held.
+void Prefetcher::restartAt(int64_t offset)
+{
+    mStart = offset;
+    mHead = 0;
+    mFilled = 0;
+    mGeneration++;
+    mDone = false;
+    mStatus = 0;
+    mCondition.signal();
+}
+
+ssize_t Prefetcher::read(int64_t offset, unsigned char *buf, size_t size)
+{
+    Mutex::Autolock autoLock(mLock);
+    bool waited = false;
+
+    if (offset < mStart || offset > mStart + (int64_t)mFilled) {
+        restartAt(offset);
+    } else {
+        // drop what is behind the reader, to make room ahead of it
+        size_t consumed = offset - mStart;
+        mHead = (mHead + consumed) % mSize;
+        mFilled -= consumed;
+        mStart = offset;
+    }
+
+    while (mFilled == 0 && !mDone && !mStop) {
+        // the worker may be stuck in readAt(), keep polling for an abort
+        if (io_interrupted(mInterrupt)) {
+            return AVERROR_EXIT;
+        }
+        waited = true;
+        mCondition.signal();
+        mDataCondition.waitRelative(mLock, INTERRUPT_POLL_NS);
+    }
+
+    if (mFilled == 0) {
+        return mStatus;
+    }
+
+    if (waited) {
+        mStats.misses++;
+    } else {
+        mStats.hits++;
+    }
+
+    size = FFMIN(size, mFilled);
+    size_t first = FFMIN(size, mSize - mHead);
+    memcpy(buf, mBuffer + mHead, first);
+    memcpy(buf + first, mBuffer, size - first);
+
+    mHead = (mHead + size) % mSize;
+    mFilled -= size;
+    mStart += size;
+    mCondition.signal();
+
+    return size;
+}
+
+void Prefetcher::seek(int64_t offset)
+{
+    Mutex::Autolock autoLock(mLock);
+
+    if (offset < mStart || offset > mStart + (int64_t)mFilled) {
+        restartAt(offset);
+    }
+}
+
+void Prefetcher::getStats(FFSourceStats *stats)
+{
+    Mutex::Autolock autoLock(mLock);
+    *stats = mStats;
+}
+
+/////////////////////////////////////////////////////////////////
+
 class FFSource
 {
 public:
-    void set(CDataSource *s);
+    void set(CDataSource *s, const AVIOInterruptCB *interrupt);
     void reset();
-    int init_check();
     int read(unsigned char *buf, size_t size);
-    int64_t seek(int64_t pos);
+    int64_t seek(int64_t offset, int whence);
     off64_t getSize();
+    void getStats(FFSourceStats *stats);
 
 protected:
+    void openLocalFile();
+    void closeLocalFile();
+    ssize_t readLocalFile(unsigned char *buf, size_t size);
+
     CDataSource *mSource;
+    const AVIOInterruptCB *mInterrupt;  // checked between reads, may be NULL
     int64_t mOffset;
     uint32_t mFlags;
+
+    // local file fast path, bypassing the data source
+    int mFd;
+    int64_t mFileSize;
+    size_t mWindowSize;   // mmap window size, 0 to use pread
+    uint8_t *mWindow;
+    int64_t mWindowOffset;
+
+    // read-ahead of caching sources
+    Prefetcher *mPrefetch;
 };
 
-void FFSource::set(CDataSource *s)
+void FFSource::set(CDataSource *s, const AVIOInterruptCB *interrupt)
 {
     mSource = s;
+    mInterrupt = interrupt;
     mOffset = 0;
     mFlags = s->flags(s->handle);
+    mFd = -1;
+    mWindow = NULL;
+    mPrefetch = NULL;
 
     ALOGV("FFSource[%p]: flags=%08x", mSource, mFlags);
+
+    if (mFlags & DataSourceBase::kIsLocalFileSource) {
+        openLocalFile();
+    }
+
+    if (mFlags & DataSourceBase::kIsCachingDataSource) {
+        int size = property_get_int32("debug.ffmpeg.source.prefetch-size",
+                DEFAULT_PREFETCH_SIZE);
+        if (size > 0) {
+            mPrefetch = new Prefetcher(mSource, size, mInterrupt);
+            if (!mPrefetch->start()) {
+                ALOGE("FFSource[%p]: failed to start prefetching", mSource);
+                delete mPrefetch;
+                mPrefetch = NULL;
+            }
+        }
+    }
 }
 
 void FFSource::reset()
 {
     ALOGV("FFSource[%p]: reset", mSource);
+    delete mPrefetch;
+    mPrefetch = NULL;
+    closeLocalFile();
     mSource = NULL;
 }
 
-int FFSource::init_check()
+/* Local files are read directly when their path is known and accessible,
+ * and the data source covers the whole file. */
+void FFSource::openLocalFile()
+{
+    char uri[PATH_MAX] = {0};
+    const char *path = uri;
+    off64_t size = -1;
+    struct stat st;
+
+    if (!property_get_bool("debug.ffmpeg.source.direct-io", 1)
+            || !mSource->getUri(mSource->handle, uri, sizeof(uri))) {
+        return;
+    }
+    if (!strncmp(path, "file://", 7)) {
+        path += 7;
+    }
+    if (path[0] != '/') {
+        return;
+    }
+
+    mFd = open(path, O_RDONLY | O_CLOEXEC);
+    if (mFd < 0) {
+        ALOGV("FFSource[%p]: cannot open %s directly: %s", mSource, path, strerror(errno));
+        return;
+    }
+
+    if (fstat(mFd, &st) < 0 || !S_ISREG(st.st_mode)
+            || mSource->getSize(mSource->handle, &size) != OK || size != st.st_size) {
+        ALOGV("FFSource[%p]: %s does not match the data source", mSource, path);
+        closeLocalFile();
+        return;
+    }
+
+    mFileSize = st.st_size;
+    mWindowSize = FFALIGN(FFMAX(property_get_int32("debug.ffmpeg.source.mmap-window", 0), 0),
+                          sysconf(_SC_PAGESIZE));
+    mWindowOffset = 0;
+    posix_fadvise(mFd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    ALOGV("FFSource[%p]: reading %s directly (%s)", mSource, path,
+          mWindowSize ? "mmap" : "pread");
+}
+
+void FFSource::closeLocalFile()
 {
-    ALOGV("FFSource[%p]: init_check", mSource);
-    return 0;
+    if (mWindow) {
+        munmap(mWindow, mWindowSize);
+        mWindow = NULL;
+    }
+    if (mFd >= 0) {
+        close(mFd);
+        mFd = -1;
+    }
 }
 
+ssize_t FFSource::readLocalFile(unsigned char *buf, size_t size)
+{
+    struct stat st;
+
+    // Touching the mapping past the end of a truncated file raises SIGBUS,
+    // so once the file shrinks, only read it.
+    if (mWindowSize && (fstat(mFd, &st) < 0 || st.st_size < mFileSize)) {
+        ALOGW("FFSource[%p]: file truncated, no longer mapping it", mSource);
+        if (mWindow) {
+            munmap(mWindow, mWindowSize);
+            mWindow = NULL;
+        }
+        mWindowSize = 0;
+        // pread() stops at the new end by itself
+    }
+
+    if (mOffset >= mFileSize) {
+        return 0;
+    }
+    size = FFMIN((int64_t)size, mFileSize - mOffset);
+
+    if (!mWindowSize) {
+        ssize_t n;
+        do {
+            n = pread64(mFd, buf, size, mOffset);
+        } while (n < 0 && errno == EINTR);
+        return n;
+    }
+
+    // move the window over the offset, and let the kernel read ahead
+    if (!mWindow || mOffset < mWindowOffset
+            || mOffset >= mWindowOffset + (int64_t)mWindowSize) {
+        if (mWindow) {
+            munmap(mWindow, mWindowSize);
+        }
+        mWindowOffset = mOffset - mOffset % mWindowSize;
+        mWindow = (uint8_t *)mmap64(NULL, mWindowSize, PROT_READ, MAP_SHARED,
+                                    mFd, mWindowOffset);
+        if (mWindow == MAP_FAILED) {
+            mWindow = NULL;
+            return -1;
+        }
+        madvise(mWindow, mWindowSize, MADV_SEQUENTIAL);
+        madvise(mWindow, mWindowSize, MADV_WILLNEED);
+    }
+
+    size = FFMIN((int64_t)size, mWindowOffset + (int64_t)mWindowSize - mOffset);
+    size = FFMIN((int64_t)size, mFileSize - mOffset);
+    memcpy(buf, mWindow + (mOffset - mWindowOffset), size);
+    return size;
+}
+
+/* Reads until size bytes are available or the source has no more to give,
+ * so that sources returning partial reads still fill the whole avio
+ * buffer with each refill. */
 int FFSource::read(unsigned char *buf, size_t size)
 {
     ssize_t n = 0;
+    size_t total = 0;
+
+    while (total < size) {
+        if (io_interrupted(mInterrupt)) {
+            n = AVERROR_EXIT;
+            break;
+        }
+        if (mFd >= 0) {
+            n = readLocalFile(buf + total, size - total);
+            if (n < 0) {
+                ALOGW("FFSource[%p]: direct read failed (%s), using the data source",
+                      mSource, strerror(errno));
+                closeLocalFile();
+                continue;
+            }
+        } else if (mPrefetch) {
+            n = mPrefetch->read(mOffset, buf + total, size - total);
+        } else {
+            n = mSource->readAt(mSource->handle, mOffset, buf + total, size - total);
+        }
+        if (n <= 0) {
+            break;
+        }
+        ALOGV("FFsource[%p]: read = %zd", mSource, n);
+        mOffset += n;
+        total += n;
+
+        // do not wait for data that is still being prefetched
+        if (mPrefetch) {
+            break;
+        }
+    }
 
-    n = mSource->readAt(mSource->handle, mOffset, buf, size);
-    if (n == ERROR_END_OF_STREAM ||
+    if (total > 0) {
+        return total;
+    }
+
+    if (n == AVERROR_EXIT) {
+        ALOGV("FFSource[%p]: interrupted", mSource);
+        return n;
+    } else if (n == ERROR_END_OF_STREAM ||
             // For local file source, 0 bytes read means EOS.
             (n == 0 && (mFlags & DataSourceBase::kIsLocalFileSource) != 0)) {
         ALOGV("FFSource[%p]: end-of-stream", mSource);
         return AVERROR_EOF;
     } else if (n < 0) {
-        ALOGE("FFSource[%p]: readAt failed (%zu)", mSource, n);
+        ALOGE("FFSource[%p]: readAt failed (%zd)", mSource, n);
         return n == UNKNOWN_ERROR ? AVERROR(errno) : n;
     }
-    if (n > 0) {
-        ALOGV("FFsource[%p]: read = %zd", mSource, n);
-        mOffset += n;
-    }
 
     return n;
 }
 
-int64_t FFSource::seek(int64_t pos)
+int64_t FFSource::seek(int64_t offset, int whence)
 {
+    int64_t pos;
+
+    switch (whence & ~AVSEEK_FORCE) {
+    case AVSEEK_SIZE:
+        return getSize();
+    case SEEK_SET:
+        pos = offset;
+        break;
+    case SEEK_CUR:
+        pos = mOffset + offset;
+        break;
+    case SEEK_END: {
+        off64_t size = getSize();
+        if (size < 0)
+            return size;
+        pos = size + offset;
+        break;
+    }
+    default:
+        return AVERROR(EINVAL);
+    }
+
+    if (pos < 0) {
+        ALOGE("FFSource[%p]: invalid seek to %" PRId64, mSource, pos);
+        return AVERROR(EINVAL);
+    }
+
     ALOGV("FFSource[%p]: seek = %" PRId64, mSource, pos);
     mOffset = pos;
-    return 0;
+    if (mPrefetch) {
+        mPrefetch->seek(pos);
+    }
+    return pos;
+}
+
+void FFSource::getStats(FFSourceStats *stats)
+{
+    if (mPrefetch) {
+        mPrefetch->getStats(stats);
+    } else {
+        memset(stats, 0, sizeof(*stats));
+    }
 }
 
 off64_t FFSource::getSize()
@@ -117,25 +571,27 @@ off64_t FFSource::getSize()
 
 /////////////////////////////////////////////////////////////////
 
-static int android_open(URLContext *h, const char *url, int flags __unused)
+static CDataSource *parse_url(const char *url)
 {
     // the url in form of "android-source:<CDataSource Ptr>",
     // the DataSourceBase Pointer passed by the ffmpeg extractor
     CDataSource *source = NULL;
     char url_check[PATH_MAX] = {0};
 
-    ALOGV("android source begin open");
-
     if (!url) {
         ALOGE("android url is null!");
-        return -1;
+        return NULL;
     }
 
     ALOGV("android open, url: %s", url);
+    if (strncmp(url, "android-source:", strlen("android-source:"))) {
+        ALOGE("ffmpeg open data source error! (not an android source)");
+        return NULL;
+    }
     sscanf(url + strlen("android-source:"), "%p", &source);
     if(source == NULL){
         ALOGE("ffmpeg open data source error! (invalid source)");
-        return -1;
+        return NULL;
     }
 
     snprintf(url_check, sizeof(url_check), "android-source:%p",
@@ -146,7 +602,7 @@ static int android_open(URLContext *h, const char *url, int flags __unused)
         char uri[PATH_MAX] = {0};
         if (!source->getUri(source->handle, uri, sizeof(uri))) {
             ALOGE("ffmpeg open data source error! (source uri)");
-            return -1;
+            return NULL;
         }
 
         snprintf(url_check, sizeof(url_check), "android-source:%p|file:%s",
@@ -154,83 +610,119 @@ static int android_open(URLContext *h, const char *url, int flags __unused)
 
         if (strcmp(url_check, url) != 0) {
             ALOGE("ffmpeg open data source error! (url check)");
-            return -1;
+            return NULL;
         }
     }
 
     ALOGV("ffmpeg open android data source success, source ptr: %p", source);
 
-    reinterpret_cast<FFSource *>(h->priv_data)->set(source);
+    return source;
+}
 
-    ALOGV("android source open success");
+/////////////////////////////////////////////////////////////////
 
-    return 0;
+static int io_read(void *opaque, uint8_t *buf, int size)
+{
+    int n = reinterpret_cast<FFSource *>(opaque)->read(buf, size);
+    return n == 0 ? AVERROR_EOF : n;
 }
-static int android_read(URLContext *h, unsigned char *buf, int size)
+
+static int64_t io_seek(void *opaque, int64_t offset, int whence)
 {
-    FFSource* ffs = (FFSource *)h->priv_data;
-    return ffs->read(buf, size);
+    return reinterpret_cast<FFSource *>(opaque)->seek(offset, whence);
 }
 
-static int android_write(URLContext *h __unused, const unsigned char *buf __unused, int size __unused)
+static int io_buffer_size()
 {
-    return -1;
+    int size = property_get_int32("debug.ffmpeg.source.buffer-size",
+            DEFAULT_IO_BUFFER_SIZE);
+
+    size = FFMIN(FFMAX(size, MIN_IO_BUFFER_SIZE), MAX_IO_BUFFER_SIZE);
+    return FFALIGN(size, MIN_IO_BUFFER_SIZE);
 }
 
-static int64_t android_seek(URLContext *h, int64_t pos, int whence)
+int ffmpeg_source_open_input(AVFormatContext **ps, const char *url,
+        const AVInputFormat *fmt, AVDictionary **options)
 {
-    FFSource* ffs = (FFSource*)h->priv_data;
+    AVFormatContext *ic = *ps;
+    CDataSource *source;
+    FFSource *ffs;
+    AVIOContext *pb;
+    uint8_t *buffer;
+    int size, err;
+
+    source = parse_url(url);
+    if (source == NULL) {
+        avformat_free_context(ic);
+        *ps = NULL;
+        return AVERROR(EINVAL);
+    }
 
-    if (whence == AVSEEK_SIZE) {
-        return ffs->getSize();
+    if (!ic && !(ic = avformat_alloc_context())) {
+        return AVERROR(ENOMEM);
     }
 
-    ffs->seek(pos);
-    return 0;
-}
+    size = io_buffer_size();
+    // ic->interrupt_callback may still be set up after opening
+    ffs = new FFSource;
+    ffs->set(source, &ic->interrupt_callback);
+    buffer = (uint8_t *)av_malloc(size);
+    pb = buffer ? avio_alloc_context(buffer, size, 0, ffs, io_read, NULL, io_seek) : NULL;
+    if (!pb) {
+        av_free(buffer);
+        ffs->reset();
+        delete ffs;
+        avformat_free_context(ic);
+        *ps = NULL;
+        return AVERROR(ENOMEM);
+    }
 
-static int android_close(URLContext *h)
-{
-    ALOGV("android source close");
-    reinterpret_cast<FFSource *>(h->priv_data)->reset();
-    return 0;
-}
+    ic->pb = pb;
+    ic->flags |= AVFMT_FLAG_CUSTOM_IO;
+
+    // url is only used to guess the format from the file extension now
+    err = avformat_open_input(&ic, url, fmt, options);
+    if (err < 0) {
+        // ic was freed, but not its custom I/O context
+        av_freep(&pb->buffer);
+        avio_context_free(&pb);
+        ffs->reset();
+        delete ffs;
+    }
 
-static int android_get_handle(URLContext *h)
-{
-    return (intptr_t)h->priv_data;
+    *ps = ic;
+    return err;
 }
 
-static int android_check(URLContext *h, int mask)
+bool ffmpeg_source_get_stats(AVFormatContext *ic, FFSourceStats *stats)
 {
-    FFSource* ffs = (FFSource*)h->priv_data;
-
-    /* url_check does not guarantee url_open will be called
-     * (and actually it is not designed to do so)
-     * If url_open is not called before url_check called, ffs
-     * will be null, and we will assume everything is ok.
-     */
-    if (ffs && (ffs->init_check() < 0))
-        return AVERROR(EACCES); // FIXME
+    if (!ic || !ic->pb || !(ic->flags & AVFMT_FLAG_CUSTOM_IO)) {
+        return false;
+    }
 
-    return (mask & AVIO_FLAG_READ);
+    reinterpret_cast<FFSource *>(ic->pb->opaque)->getStats(stats);
+    return true;
 }
 
-extern "C" URLProtocol ff_android_protocol;
-
-void ffmpeg_register_android_source()
+void ffmpeg_source_close_input(AVFormatContext **ps)
 {
-    if (ff_android_protocol.name) return;
+    AVFormatContext *ic = *ps;
+    AVIOContext *pb;
 
-    ff_android_protocol.name                = "android-source";
-    ff_android_protocol.url_open            = android_open;
-    ff_android_protocol.url_read            = android_read;
-    ff_android_protocol.url_write           = android_write;
-    ff_android_protocol.url_seek            = android_seek;
-    ff_android_protocol.url_close           = android_close;
-    ff_android_protocol.url_get_file_handle = android_get_handle;
-    ff_android_protocol.url_check           = android_check;
-    ff_android_protocol.priv_data_size      = sizeof(FFSource);
+    if (!ic) {
+        return;
+    }
+
+    pb = (ic->flags & AVFMT_FLAG_CUSTOM_IO) ? ic->pb : NULL;
+    avformat_close_input(ps);
+
+    if (pb) {
+        FFSource *ffs = reinterpret_cast<FFSource *>(pb->opaque);
+        ffs->reset();
+        delete ffs;
+        av_freep(&pb->buffer);
+        avio_context_free(&pb);
+    }
 }
 
 }  // namespace android
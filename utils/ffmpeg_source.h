@@ -18,9 +18,28 @@
 
 #define FFMPEG_SOURCE_H_
 
+#include <stdint.h>
+
+struct AVDictionary;
+struct AVFormatContext;
+struct AVInputFormat;
+
 namespace android {
 
-void ffmpeg_register_android_source(void);
+// read-ahead statistics of caching data sources
+struct FFSourceStats {
+    int64_t hits;       // reads served from prefetched data
+    int64_t misses;     // reads that had to wait for the source
+    int64_t prefetched; // bytes read ahead
+};
+
+// Opens "android-source:" urls through an AVIOContext reading the data
+// source directly, with the same semantics as avformat_open_input().
+// Such contexts must be closed by ffmpeg_source_close_input().
+int ffmpeg_source_open_input(struct AVFormatContext **ps, const char *url,
+        const struct AVInputFormat *fmt, struct AVDictionary **options);
+void ffmpeg_source_close_input(struct AVFormatContext **ps);
+bool ffmpeg_source_get_stats(struct AVFormatContext *ic, FFSourceStats *stats);
 
 }  // namespace android
 
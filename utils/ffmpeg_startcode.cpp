@@ -0,0 +1,82 @@
+/*
+ * Copyright (C) 2026 The Android-x86 Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+#include "ffmpeg_startcode.h"
+
+namespace android {
+
+/* Returns the first 00 00 01 start code in [p, end), or end if there is
+ * none. Blocks without any zero byte cannot hold the start of one, and are
+ * skipped 16 bytes at a time. */
+const uint8_t *ffmpeg_find_startcode(const uint8_t *p, const uint8_t *end)
+{
+#if defined(__SSE2__)
+    const __m128i zero = _mm_setzero_si128();
+
+    while (end - p >= 16 + 2) {
+        __m128i v = _mm_loadu_si128((const __m128i *)p);
+        unsigned int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(v, zero));
+
+        while (mask) {
+            int i = __builtin_ctz(mask);
+            if (p[i + 1] == 0 && p[i + 2] == 1)
+                return p + i;
+            mask &= mask - 1;
+        }
+        p += 16;
+    }
+#elif defined(__ARM_NEON)
+    const uint8x16_t zero = vdupq_n_u8(0);
+
+    while (end - p >= 16 + 2) {
+        uint8x16_t eq = vceqq_u8(vld1q_u8(p), zero);
+        uint32x2_t any = vreinterpret_u32_u8(vorr_u8(vget_low_u8(eq), vget_high_u8(eq)));
+
+        if (vget_lane_u32(any, 0) | vget_lane_u32(any, 1)) {
+            for (int i = 0; i < 16; i++) {
+                if (p[i] == 0 && p[i + 1] == 0 && p[i + 2] == 1)
+                    return p + i;
+            }
+        }
+        p += 16;
+    }
+#endif
+
+    if (end - p < 3)
+        return end;
+
+    // p points at the last byte of a candidate, a large value there rules
+    // out the next two candidates as well
+    for (p += 2; p < end; ) {
+        if (p[0] > 1)
+            p += 3;
+        else if (p[-1])
+            p += 2;
+        else if (p[-2] || p[0] != 1)
+            p++;
+        else
+            return p - 2;
+    }
+    return end;
+}
+
+}  // namespace android
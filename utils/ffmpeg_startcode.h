@@ -0,0 +1,30 @@
+/*
+ * Copyright (C) 2026 The Android-x86 Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef FFMPEG_STARTCODE_H_
+
+#define FFMPEG_STARTCODE_H_
+
+#include <stdint.h>
+
+namespace android {
+
+// Kept apart from ffmpeg_utils, so that it builds without libav*.
+const uint8_t *ffmpeg_find_startcode(const uint8_t *p, const uint8_t *end);
+
+}  // namespace android
+
+#endif  // FFMPEG_STARTCODE_H_
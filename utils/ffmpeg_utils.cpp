@@ -23,6 +23,7 @@
 extern "C" {
 
 #include "config.h"
+#include "libavutil/intreadwrite.h"
 
 #include <unistd.h>
 #include <stdlib.h>
@@ -30,16 +31,20 @@ extern "C" {
 #include <math.h>
 #include <limits.h> /* INT_MAX */
 #include <time.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <sys/stat.h>
 
 #undef strncpy
 #include <string.h>
 
 }
 
+#include <atomic>
+
 #include <cutils/properties.h>
 
 #include "ffmpeg_utils.h"
-#include "ffmpeg_source.h"
 
 // log
 static int flags;
@@ -201,9 +206,6 @@ status_t initFFmpeg()
         /* global ffmpeg initialization */
         avformat_network_init();
 
-        /* register android source */
-        ffmpeg_register_android_source();
-
         ALOGI("FFMPEG initialized: %s", av_version_info());
     }
 
@@ -237,35 +239,33 @@ void deInitFFmpeg()
 static int h264_split(AVCodecParameters *avpar __unused,
         const uint8_t *buf, int buf_size, int check_compatible_only)
 {
-    int i;
-    uint32_t state = -1;
+    const uint8_t *end = buf + buf_size;
+    const uint8_t *p = ffmpeg_find_startcode(buf, end);
     int has_sps= 0;
     int has_pps= 0;
 
     //av_hex_dump(stderr, buf, 100);
 
-    for(i=0; i<=buf_size; i++){
-        if((state&0xFFFFFF1F) == 0x107) {
+    // the NAL header follows the start code
+    for (; end - p > 3; p = ffmpeg_find_startcode(p + 3, end)) {
+        int nal_type = p[3] & 0x1F;
+
+        if (nal_type == 7) {
             ALOGI("found NAL_SPS");
             has_sps=1;
-        }
-        if((state&0xFFFFFF1F) == 0x108) {
+        } else if (nal_type == 8) {
             ALOGI("found NAL_PPS");
             has_pps=1;
             if (check_compatible_only)
                 return (has_sps & has_pps);
-        }
-        if((state&0xFFFFFF00) == 0x100
-                && ((state&0xFFFFFF1F) == 0x101
-                    || (state&0xFFFFFF1F) == 0x102
-                    || (state&0xFFFFFF1F) == 0x105)){
+        } else if (nal_type == 1 || nal_type == 2 || nal_type == 5) {
             if(has_pps){
-                while(i>4 && buf[i-5]==0) i--;
-                return i-4;
+                // leading zeros belong to the slice
+                int i = p - buf;
+                while(i>0 && buf[i-1]==0) i--;
+                return i;
             }
         }
-        if (i<buf_size)
-            state= (state<<8) | buf[i];
     }
     return 0;
 }
@@ -273,16 +273,18 @@ static int h264_split(AVCodecParameters *avpar __unused,
 static int mpegvideo_split(AVCodecParameters *avpar __unused,
         const uint8_t *buf, int buf_size, int check_compatible_only __unused)
 {
-    int i;
-    uint32_t state= -1;
+    const uint8_t *end = buf + buf_size;
+    const uint8_t *p = ffmpeg_find_startcode(buf, end);
     int found=0;
 
-    for(i=0; i<buf_size; i++){
-        state= (state<<8) | buf[i];
-        if(state == 0x1B3){
+    for (; end - p > 3; p = ffmpeg_find_startcode(p + 3, end)) {
+        if (p[3] == 0xB3) {
+            // sequence header
             found=1;
-        }else if(found && state != 0x1B5 && state < 0x200 && state >= 0x100)
-            return i-3;
+        } else if (found && p[3] != 0xB5) {
+            // anything but a sequence extension ends it
+            return p - buf;
+        }
     }
     return 0;
 }
@@ -331,106 +333,178 @@ int is_extradata_compatible_with_android(AVCodecParameters *avpar)
 // packet queue
 //////////////////////////////////////////////////////////////////////////////////
 
-typedef struct PacketList {
+/*
+ * Single producer (the demuxer) / single consumer (the track) queue, after
+ * Dmitry Vyukov's unbounded SPSC queue. Nodes and their AVPacket are never
+ * freed while the queue lives: the producer recycles the nodes the consumer
+ * went past, so packets are handed over by moving references only, and the
+ * only lock is taken to wake up a consumer that blocks on an empty queue.
+ *
+ * packet_queue_flush() drains from the consumer side, so it must not race
+ * with packet_queue_get().
+ */
+#define PACKET_QUEUE_PREALLOC 64
+
+typedef struct PacketNode {
     AVPacket *pkt;
-    struct PacketList *next;
-} PacketList;
+    std::atomic<struct PacketNode *> next;
+} PacketNode;
 
 typedef struct PacketQueue {
-    PacketList *first_pkt, *last_pkt;
-    int nb_packets;
-    int size;
-    int wait_for_data;
-    int abort_request;
+    // consumer side
+    std::atomic<PacketNode *> head;     // dummy node, its packet was consumed
+    // producer side
+    PacketNode *tail;
+    PacketNode *first;                  // oldest node that may be recycled
+    PacketNode *head_copy;              // nodes before it are free to reuse
+    std::atomic<int> nb_packets;
+    std::atomic<int> size;
+    std::atomic<int> wait_for_data;
+    std::atomic<int> abort_request;
     Mutex lock;
     Condition cond;
 } PacketQueue;
 
+static PacketNode *packet_node_alloc()
+{
+    PacketNode *node = new PacketNode;
+    node->pkt = av_packet_alloc();
+    if (!node->pkt) {
+        delete node;
+        return NULL;
+    }
+    node->next.store(NULL, std::memory_order_relaxed);
+    return node;
+}
+
+// producer only
+static PacketNode *packet_queue_get_node(PacketQueue *q)
+{
+    PacketNode *node;
+
+    if (q->first == q->head_copy) {
+        q->head_copy = q->head.load(std::memory_order_acquire);
+    }
+    if (q->first != q->head_copy) {
+        node = q->first;
+        q->first = node->next.load(std::memory_order_relaxed);
+        node->next.store(NULL, std::memory_order_relaxed);
+        return node;
+    }
+    return packet_node_alloc();
+}
+
 PacketQueue* packet_queue_alloc()
 {
-    PacketQueue *queue = (PacketQueue*)av_mallocz(sizeof(PacketQueue));
-    if (queue) {
-        queue->abort_request = 1;
-        return queue;
+    PacketQueue *q = new PacketQueue;
+    PacketNode *node = packet_node_alloc();
+    if (!node) {
+        delete q;
+        return NULL;
+    }
+
+    q->head.store(node, std::memory_order_relaxed);
+    q->tail = q->first = q->head_copy = node;
+    q->nb_packets = 0;
+    q->size = 0;
+    q->wait_for_data = 0;
+    q->abort_request = 1;
+
+    // chain spare nodes behind the dummy one, ready to be recycled
+    for (int i = 0; i < PACKET_QUEUE_PREALLOC; i++) {
+        PacketNode *spare = packet_node_alloc();
+        if (!spare)
+            break;
+        spare->next.store(q->first, std::memory_order_relaxed);
+        q->first = spare;
     }
-    return NULL;
+    q->head_copy = node;
+
+    return q;
 }
 
 void packet_queue_free(PacketQueue **q)
 {
+    PacketNode *node, *next;
+
+    if (!*q)
+        return;
+
     packet_queue_abort(*q);
     packet_queue_flush(*q);
-    av_freep(q);
+
+    for (node = (*q)->first; node != NULL; node = next) {
+        next = node->next.load(std::memory_order_relaxed);
+        av_packet_free(&node->pkt);
+        delete node;
+    }
+    delete *q;
+    *q = NULL;
 }
 
 void packet_queue_abort(PacketQueue *q)
 {
     q->abort_request = 1;
     Mutex::Autolock autoLock(q->lock);
-    q->cond.signal();
+    q->cond.broadcast();
 }
 
-static int packet_queue_put_private(PacketQueue *q, AVPacket *pkt)
+int packet_queue_put(PacketQueue *q, AVPacket *pkt)
 {
-    PacketList *pkt1;
+    PacketNode *node;
 
     if (q->abort_request)
         return -1;
 
-    pkt1 = (PacketList *)av_malloc(sizeof(PacketList));
-    if (!pkt1)
+    node = packet_queue_get_node(q);
+    if (!node)
         return -1;
-    pkt1->pkt = av_packet_alloc();
-    if (!pkt1->pkt) {
-        av_free(pkt1);
-        return -1;
-    }
-    av_packet_move_ref(pkt1->pkt, pkt);
-    pkt1->next = NULL;
 
-    if (!q->last_pkt)
-        q->first_pkt = pkt1;
-    else
-        q->last_pkt->next = pkt1;
-    q->last_pkt = pkt1;
+    av_packet_move_ref(node->pkt, pkt);
+    // count before publishing, so the consumer never sees negative values
     q->nb_packets++;
-    //q->size += pkt1->pkt.size + sizeof(*pkt1);
-    q->size += pkt1->pkt->size;
-    q->cond.signal();
+    q->size += node->pkt->size;
+    q->tail->next.store(node, std::memory_order_release);
+    q->tail = node;
+
+    // pairs with the fence in packet_queue_get()
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (q->wait_for_data.load(std::memory_order_relaxed)) {
+        Mutex::Autolock autoLock(q->lock);
+        q->cond.signal();
+    }
     return 0;
 }
 
-int packet_queue_put(PacketQueue *q, AVPacket *pkt)
+int packet_queue_is_wait_for_data(PacketQueue *q)
 {
-    int ret;
-
-    q->lock.lock();
-    ret = packet_queue_put_private(q, pkt);
-    q->lock.unlock();
-
-    return ret;
+    return q->wait_for_data;
 }
 
-int packet_queue_is_wait_for_data(PacketQueue *q)
+// consumer only
+static bool packet_queue_pop(PacketQueue *q, AVPacket *pkt)
 {
-    Mutex::Autolock autoLock(q->lock);
-    return q->wait_for_data;
+    PacketNode *head = q->head.load(std::memory_order_relaxed);
+    PacketNode *next = head->next.load(std::memory_order_acquire);
+
+    if (!next)
+        return false;
+
+    q->nb_packets--;
+    q->size -= next->pkt->size;
+    if (pkt)
+        av_packet_move_ref(pkt, next->pkt);
+    else
+        av_packet_unref(next->pkt);
+    // next becomes the dummy node, hand the old one back to the producer
+    q->head.store(next, std::memory_order_release);
+    return true;
 }
 
 void packet_queue_flush(PacketQueue *q)
 {
-    PacketList *pkt, *pkt1;
-
-    Mutex::Autolock autoLock(q->lock);
-    for (pkt = q->first_pkt; pkt != NULL; pkt = pkt1) {
-        pkt1 = pkt->next;
-        av_packet_free(&pkt->pkt);
-        av_freep(&pkt);
-    }
-    q->last_pkt = NULL;
-    q->first_pkt = NULL;
-    q->nb_packets = 0;
-    q->size = 0;
+    while (packet_queue_pop(q, NULL))
+        ;
 }
 
 int packet_queue_put_nullpacket(PacketQueue *q, int stream_index)
@@ -452,43 +526,300 @@ int packet_queue_put_nullpacket(PacketQueue *q, int stream_index)
 /* return < 0 if aborted, 0 if no packet and > 0 if packet.  */
 int packet_queue_get(PacketQueue *q, AVPacket *pkt, int block)
 {
-    PacketList *pkt1;
-    int ret = -1;
-
-    Mutex::Autolock autoLock(q->lock);
-
     while (!q->abort_request) {
-        pkt1 = q->first_pkt;
-        if (pkt1) {
-            q->first_pkt = pkt1->next;
-            if (!q->first_pkt)
-                q->last_pkt = NULL;
-            q->nb_packets--;
-            //q->size -= pkt1->pkt.size + sizeof(*pkt1);
-            q->size -= pkt1->pkt->size;
-            av_packet_move_ref(pkt, pkt1->pkt);
-            av_packet_free(&pkt1->pkt);
-            av_free(pkt1);
-            ret = 1;
-            break;
-        } else if (!block) {
-            ret = 0;
-            break;
-        } else {
-            q->wait_for_data = 1;
-            q->cond.waitRelative(q->lock, 10000000LL);
-        }
+        if (packet_queue_pop(q, pkt))
+            return 1;
+        if (!block)
+            return 0;
+
+        Mutex::Autolock autoLock(q->lock);
+        q->wait_for_data.store(1, std::memory_order_relaxed);
+        // pairs with the fence in packet_queue_put()
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        PacketNode *head = q->head.load(std::memory_order_relaxed);
+        if (!q->abort_request && !head->next.load(std::memory_order_acquire))
+            q->cond.wait(q->lock);
+        q->wait_for_data.store(0, std::memory_order_relaxed);
     }
-    q->wait_for_data = 0;
-    return ret;
+    return -1;
 }
 
 void packet_queue_start(PacketQueue *q)
 {
-    Mutex::Autolock autoLock(q->lock);
     q->abort_request = 0;
 }
 
+int packet_queue_nb_packets(PacketQueue *q)
+{
+    return q->nb_packets;
+}
+
+int packet_queue_size(PacketQueue *q)
+{
+    return q->size;
+}
+
+//////////////////////////////////////////////////////////////////////////////////
+// packet pool
+//////////////////////////////////////////////////////////////////////////////////
+
+/*
+ * Payload buffers in power of two size classes, from 1KiB to 4MiB. Pooled
+ * buffers may outlive the pool: AVBufferPool frees them when they return.
+ */
+#define PACKET_POOL_MIN_SHIFT   10
+#define PACKET_POOL_MAX_SHIFT   22
+#define PACKET_POOL_CLASSES     (PACKET_POOL_MAX_SHIFT - PACKET_POOL_MIN_SHIFT + 1)
+
+typedef struct PacketPool {
+    AVBufferPool *classes[PACKET_POOL_CLASSES];
+    Mutex lock;     // protects the lazy creation of the classes
+    std::atomic<int64_t> requests;
+    std::atomic<int64_t> allocations;
+    std::atomic<int64_t> oversized;
+} PacketPool;
+
+static AVBufferRef *packet_pool_alloc_buffer(void *opaque, size_t size)
+{
+    PacketPool *pool = (PacketPool *)opaque;
+
+    pool->allocations++;
+    return av_buffer_alloc(size);
+}
+
+PacketPool* packet_pool_alloc()
+{
+    PacketPool *pool = new PacketPool;
+
+    memset(pool->classes, 0, sizeof(pool->classes));
+    pool->requests = 0;
+    pool->allocations = 0;
+    pool->oversized = 0;
+    return pool;
+}
+
+void packet_pool_free(PacketPool **pool)
+{
+    if (!*pool)
+        return;
+
+    for (int i = 0; i < PACKET_POOL_CLASSES; i++) {
+        av_buffer_pool_uninit(&(*pool)->classes[i]);
+    }
+    delete *pool;
+    *pool = NULL;
+}
+
+/* Returns a buffer of at least size bytes, followed by zeroed padding. */
+AVBufferRef* packet_pool_get(PacketPool *pool, int size)
+{
+    AVBufferRef *buf;
+    int shift = PACKET_POOL_MIN_SHIFT;
+    int needed = size + AV_INPUT_BUFFER_PADDING_SIZE;
+
+    if (size < 0)
+        return NULL;
+
+    while (shift <= PACKET_POOL_MAX_SHIFT && (1 << shift) < needed)
+        shift++;
+
+    pool->requests++;
+
+    if (shift > PACKET_POOL_MAX_SHIFT) {
+        pool->oversized++;
+        buf = av_buffer_alloc(needed);
+    } else {
+        int i = shift - PACKET_POOL_MIN_SHIFT;
+        {
+            Mutex::Autolock autoLock(pool->lock);
+            if (!pool->classes[i]) {
+                pool->classes[i] = av_buffer_pool_init2(1 << shift, pool,
+                        packet_pool_alloc_buffer, NULL);
+            }
+        }
+        buf = pool->classes[i] ? av_buffer_pool_get(pool->classes[i]) : NULL;
+    }
+
+    if (buf) {
+        memset(buf->data + size, 0, AV_INPUT_BUFFER_PADDING_SIZE);
+    }
+    return buf;
+}
+
+/* Like av_packet_make_writable(), but copies into a pooled buffer. */
+int packet_pool_make_writable(PacketPool *pool, AVPacket *pkt)
+{
+    AVBufferRef *buf;
+
+    if (pkt->buf && av_buffer_is_writable(pkt->buf))
+        return 0;
+
+    buf = packet_pool_get(pool, pkt->size);
+    if (!buf)
+        return AVERROR(ENOMEM);
+
+    if (pkt->size)
+        memcpy(buf->data, pkt->data, pkt->size);
+
+    av_buffer_unref(&pkt->buf);
+    pkt->buf = buf;
+    pkt->data = buf->data;
+    return 0;
+}
+
+/* Moves the payload into a pooled buffer, which pkt then owns alone. */
+int packet_pool_adopt(PacketPool *pool, AVPacket *pkt)
+{
+    AVBufferRef *buf;
+
+    if (!pkt->data)
+        return 0;
+
+    buf = packet_pool_get(pool, pkt->size);
+    if (!buf)
+        return AVERROR(ENOMEM);
+
+    memcpy(buf->data, pkt->data, pkt->size);
+
+    av_buffer_unref(&pkt->buf);
+    pkt->buf = buf;
+    pkt->data = buf->data;
+    return 0;
+}
+
+void packet_pool_get_stats(PacketPool *pool, PacketPoolStats *stats)
+{
+    stats->requests = pool->requests;
+    stats->allocations = pool->allocations;
+    stats->oversized = pool->oversized;
+}
+
+//////////////////////////////////////////////////////////////////////////////////
+// sidecar cache
+//////////////////////////////////////////////////////////////////////////////////
+#define CACHE_MAGIC     MKTAG('F', 'F', 'X', 'C')
+#define CACHE_VERSION   1
+#define CACHE_MAX_SIZE  (16 * 1024 * 1024)
+#define CACHE_HDR_SIZE  20
+
+/* FNV-1a */
+uint64_t ffmpeg_cache_hash(uint64_t hash, const void *data, size_t size)
+{
+    const uint8_t *p = (const uint8_t *)data;
+
+    if (hash == 0)
+        hash = 0xcbf29ce484222325ULL;
+    while (size--) {
+        hash ^= *p++;
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+static bool cache_path(const char *type, uint64_t key, char *path, size_t size)
+{
+    char dir[PROPERTY_VALUE_MAX];
+
+    if (property_get("debug.ffmpeg.extractor.cache-dir", dir, NULL) <= 0)
+        return false;
+
+    snprintf(path, size, "%s/%s-%016" PRIx64, dir, type, key);
+    return true;
+}
+
+bool ffmpeg_cache_enabled()
+{
+    char dir[PROPERTY_VALUE_MAX];
+    return property_get("debug.ffmpeg.extractor.cache-dir", dir, NULL) > 0;
+}
+
+int ffmpeg_cache_load(const char *type, uint64_t key, uint8_t **data, int *size)
+{
+    char path[PATH_MAX];
+    uint8_t hdr[CACHE_HDR_SIZE];
+    uint8_t *buf = NULL;
+    int fd, len;
+
+    *data = NULL;
+    *size = 0;
+
+    if (!cache_path(type, key, path, sizeof(path)))
+        return AVERROR(ENOSYS);
+
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return AVERROR(errno);
+
+    if (read(fd, hdr, sizeof(hdr)) != sizeof(hdr)
+            || AV_RL32(hdr) != CACHE_MAGIC
+            || AV_RL32(hdr + 4) != CACHE_VERSION) {
+        ALOGW("ignoring stale cache file %s", path);
+        goto fail;
+    }
+
+    len = AV_RL32(hdr + 8);
+    if (len <= 0 || len > CACHE_MAX_SIZE)
+        goto fail;
+
+    buf = (uint8_t *)av_malloc(len);
+    if (!buf || read(fd, buf, len) != len
+            || ffmpeg_cache_hash(0, buf, len) != AV_RL64(hdr + 12)) {
+        ALOGW("ignoring corrupted cache file %s", path);
+        goto fail;
+    }
+
+    close(fd);
+    *data = buf;
+    *size = len;
+    return 0;
+
+fail:
+    av_free(buf);
+    close(fd);
+    return AVERROR_INVALIDDATA;
+}
+
+int ffmpeg_cache_store(const char *type, uint64_t key, const uint8_t *data, int size)
+{
+    char path[PATH_MAX], tmp[PATH_MAX + 8];
+    uint8_t hdr[CACHE_HDR_SIZE];
+    int fd, err = 0;
+
+    if (size <= 0 || size > CACHE_MAX_SIZE)
+        return AVERROR(EINVAL);
+    if (!cache_path(type, key, path, sizeof(path)))
+        return AVERROR(ENOSYS);
+
+    AV_WL32(hdr, CACHE_MAGIC);
+    AV_WL32(hdr + 4, CACHE_VERSION);
+    AV_WL32(hdr + 8, size);
+    AV_WL64(hdr + 12, ffmpeg_cache_hash(0, data, size));
+
+    // write a temporary file and rename it, readers never see partial files
+    snprintf(tmp, sizeof(tmp), "%s.%d", path, gettid());
+    fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd < 0) {
+        err = AVERROR(errno);
+        ALOGW("failed to create cache file %s: %s", tmp, av_err2str(err));
+        return err;
+    }
+
+    if (write(fd, hdr, sizeof(hdr)) != sizeof(hdr)
+            || write(fd, data, size) != size) {
+        err = AVERROR(EIO);
+    }
+    close(fd);
+
+    if (!err && rename(tmp, path) < 0)
+        err = AVERROR(errno);
+    if (err) {
+        ALOGW("failed to write cache file %s: %s", path, av_err2str(err));
+        unlink(tmp);
+    }
+
+    return err;
+}
+
 //////////////////////////////////////////////////////////////////////////////////
 // misc
 //////////////////////////////////////////////////////////////////////////////////
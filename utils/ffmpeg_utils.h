@@ -26,6 +26,8 @@
 #include <utils/Errors.h>
 #include <utils/Mutex.h>
 
+#include "ffmpeg_startcode.h"
+
 extern "C" {
 
 #include "config.h"
@@ -86,6 +88,39 @@ int packet_queue_is_wait_for_data(PacketQueue *q);
 int packet_queue_put(PacketQueue *q, AVPacket *pkt);
 int packet_queue_put_nullpacket(PacketQueue *q, int stream_index);
 int packet_queue_get(PacketQueue *q, AVPacket *pkt, int block);
+int packet_queue_nb_packets(PacketQueue *q);
+int packet_queue_size(PacketQueue *q);
+
+//////////////////////////////////////////////////////////////////////////////////
+// packet pool
+//////////////////////////////////////////////////////////////////////////////////
+
+/* Backs the payloads of the queued packets: libavformat offers no hook to
+ * allocate them, so small ones are copied into the pool as they are
+ * queued. Also backs the GOP cache, and the packets made writable for the
+ * NAL conversion. */
+typedef struct PacketPool PacketPool;
+
+typedef struct PacketPoolStats {
+    int64_t requests;     // buffers handed out
+    int64_t allocations;  // buffers that had to be allocated
+    int64_t oversized;    // requests too large to be pooled
+} PacketPoolStats;
+
+PacketPool* packet_pool_alloc();
+void packet_pool_free(PacketPool **pool);
+AVBufferRef* packet_pool_get(PacketPool *pool, int size);
+int packet_pool_make_writable(PacketPool *pool, AVPacket *pkt);
+int packet_pool_adopt(PacketPool *pool, AVPacket *pkt);
+void packet_pool_get_stats(PacketPool *pool, PacketPoolStats *stats);
+
+//////////////////////////////////////////////////////////////////////////////////
+// sidecar cache
+//////////////////////////////////////////////////////////////////////////////////
+uint64_t ffmpeg_cache_hash(uint64_t hash, const void *data, size_t size);
+bool ffmpeg_cache_enabled();
+int ffmpeg_cache_load(const char *type, uint64_t key, uint8_t **data, int *size);
+int ffmpeg_cache_store(const char *type, uint64_t key, const uint8_t *data, int size);
 
 //////////////////////////////////////////////////////////////////////////////////
 // misc
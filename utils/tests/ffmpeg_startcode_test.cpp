@@ -0,0 +1,157 @@
+/*
+ * Copyright (C) 2026 The Android-x86 Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "ffmpeg_startcode.h"
+
+namespace android {
+
+/* How the splitters used to find start codes: the offset of each 00 00 01
+ * followed by a NAL header byte. */
+static std::vector<int> scanStartcodes(const uint8_t *buf, int size)
+{
+    std::vector<int> found;
+    uint32_t state = -1;
+
+    for (int i = 0; i <= size; i++) {
+        if ((state & 0xFFFFFF00) == 0x100)
+            found.push_back(i - 4);
+        if (i < size)
+            state = (state << 8) | buf[i];
+    }
+    return found;
+}
+
+static std::vector<int> findStartcodes(const uint8_t *buf, int size)
+{
+    std::vector<int> found;
+    const uint8_t *end = buf + size;
+
+    for (const uint8_t *p = ffmpeg_find_startcode(buf, end); end - p > 3;
+            p = ffmpeg_find_startcode(p + 3, end)) {
+        found.push_back(p - buf);
+    }
+    return found;
+}
+
+/* Mostly zeros and ones, so that start codes and near misses fall on every
+ * offset of the 16 byte blocks. */
+static void fillDense(uint8_t *buf, int size, unsigned int *seed)
+{
+    for (int i = 0; i < size; i++) {
+        int r = rand_r(seed) % 8;
+        buf[i] = r < 4 ? 0 : r < 6 ? 1 : rand_r(seed);
+    }
+}
+
+/* Like slice data: start codes are rare. */
+static void fillSparse(uint8_t *buf, int size, unsigned int *seed)
+{
+    for (int i = 0; i < size; i++) {
+        buf[i] = rand_r(seed);
+    }
+    for (int n = size / 4096; n > 0; n--) {
+        int i = rand_r(seed) % (size - 3);
+        buf[i] = 0;
+        buf[i + 1] = 0;
+        buf[i + 2] = 1;
+    }
+}
+
+TEST(FFmpegStartcodeTest, MatchesByteScanOnDenseBuffers)
+{
+    unsigned int seed = 1;
+
+    for (int size = 0; size < 300; size++) {
+        for (int run = 0; run < 50; run++) {
+            // offset the buffer, the loads are unaligned
+            std::vector<uint8_t> data(size + 16);
+            uint8_t *buf = data.data() + run % 16;
+
+            fillDense(buf, size, &seed);
+            ASSERT_EQ(scanStartcodes(buf, size), findStartcodes(buf, size))
+                    << "size " << size << ", run " << run;
+        }
+    }
+}
+
+TEST(FFmpegStartcodeTest, MatchesByteScanOnSparseBuffers)
+{
+    unsigned int seed = 2;
+    std::vector<uint8_t> data(256 * 1024);
+
+    for (int run = 0; run < 20; run++) {
+        int size = data.size() - run;
+
+        fillSparse(data.data() + run, size, &seed);
+        ASSERT_EQ(scanStartcodes(data.data() + run, size),
+                  findStartcodes(data.data() + run, size)) << "run " << run;
+    }
+}
+
+TEST(FFmpegStartcodeTest, ReturnsEndWithoutStartcode)
+{
+    const uint8_t buf[] = { 0, 0, 0, 0, 2, 0, 0, 0, 1 };
+
+    EXPECT_EQ(buf + 4, ffmpeg_find_startcode(buf, buf + 4));
+    EXPECT_EQ(buf + 6, ffmpeg_find_startcode(buf + 5, buf + sizeof(buf)));
+    EXPECT_EQ(buf, ffmpeg_find_startcode(buf, buf));
+}
+
+static double elapsedMs(const struct timespec *start)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1e3 + (now.tv_nsec - start->tv_nsec) / 1e6;
+}
+
+TEST(FFmpegStartcodeTest, Throughput)
+{
+    const int size = 4 * 1024 * 1024;
+    const int loops = 20;
+    unsigned int seed = 3;
+    std::vector<uint8_t> data(size);
+    struct timespec start;
+    size_t scanned = 0, found = 0;
+
+    fillSparse(data.data(), size, &seed);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < loops; i++) {
+        scanned += scanStartcodes(data.data(), size).size();
+    }
+    double scanMs = elapsedMs(&start);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < loops; i++) {
+        found += findStartcodes(data.data(), size).size();
+    }
+    double findMs = elapsedMs(&start);
+
+    EXPECT_EQ(scanned, found);
+    printf("byte scan: %.0f MB/s, ffmpeg_find_startcode: %.0f MB/s\n",
+           size * (double)loops / scanMs / 1e3, size * (double)loops / findMs / 1e3);
+}
+
+}  // namespace android